@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""Builds a firmware delta for the OTA path in main/ota.h.
+
+    python3 firmware/mkdelta.py v1.0.4.bin latest.bin delta-1.0.4.bin
+
+The delta is one zlib stream holding:
+
+    "IRD1"  u32 oldSize  u32 newSize           header, little-endian
+    0x02    u32 oldOff   u32 len   len bytes   DIFF: new = old[oldOff..] + bytes (mod 256)
+    0x01    u32 len      len bytes             ADD: literal bytes
+    0x00                                       END
+
+DIFF is bsdiff's trick: relocated code matches the old image except for
+scattered addresses, so the difference bytes are mostly zero and compress
+to almost nothing. The device applies the ops front to back, reading the
+old bytes from the running partition, so neither side needs the whole
+image in RAM.
+
+Prints the "deltas" entry for firmware.json; the delta is applied back
+here and checked against the new image before anything is written.
+"""
+import hashlib
+import json
+import struct
+import sys
+import zlib
+
+MAGIC = b"IRD1"
+OP_END, OP_ADD, OP_DIFF = 0, 1, 2
+SEED = 16      # bytes that must match exactly to start a DIFF
+STRIDE = 4     # old image indexed every STRIDE bytes
+SLACK = 256    # give up extending a DIFF after this many bytes without gain
+
+
+def extend(old, new, o, n):
+    """Length of the DIFF starting at old[o], new[n] (bsdiff's score)."""
+    best = score = length = i = 0
+    limit = min(len(old) - o, len(new) - n)
+    while i < limit and i - length < SLACK:
+        if old[o + i] == new[n + i]:
+            score += 1
+        if 2 * score - (i + 1) > best:
+            best = 2 * score - (i + 1)
+            length = i + 1
+        i += 1
+    return length
+
+
+def diff(old, new):
+    index = {}
+    for o in range(0, len(old) - SEED + 1, STRIDE):
+        index.setdefault(old[o:o + SEED], o)
+
+    ops = []
+    lit = n = 0
+    expect = None  # old offset where the previous DIFF would continue
+    while n + SEED <= len(new):
+        o = expect if expect is not None and new[n:n + SEED] == old[expect:expect + SEED] else index.get(new[n:n + SEED])
+        if o is None:
+            n += 1
+            continue
+        length = extend(old, new, o, n)
+        if n > lit:
+            ops.append((OP_ADD, new[lit:n]))
+        ops.append((OP_DIFF, o, bytes((new[n + i] - old[o + i]) & 0xFF for i in range(length))))
+        n = lit = n + length
+        expect = o + length
+    if lit < len(new):
+        ops.append((OP_ADD, new[lit:]))
+    return ops
+
+
+def encode(old, new, ops):
+    out = bytearray(MAGIC + struct.pack("<II", len(old), len(new)))
+    for op in ops:
+        if op[0] == OP_ADD:
+            out += struct.pack("<BI", OP_ADD, len(op[1])) + op[1]
+        else:
+            out += struct.pack("<BII", OP_DIFF, op[1], len(op[2])) + op[2]
+    out.append(OP_END)
+    return zlib.compress(bytes(out), 9)
+
+
+def apply(old, delta):
+    raw = zlib.decompress(delta)
+    assert raw[:4] == MAGIC
+    old_size, new_size = struct.unpack_from("<II", raw, 4)
+    assert old_size == len(old)
+    pos, out = 12, bytearray()
+    while raw[pos] != OP_END:
+        if raw[pos] == OP_ADD:
+            (length,) = struct.unpack_from("<I", raw, pos + 1)
+            out += raw[pos + 5:pos + 5 + length]
+            pos += 5 + length
+        else:
+            o, length = struct.unpack_from("<II", raw, pos + 1)
+            d = raw[pos + 9:pos + 9 + length]
+            out += bytes((old[o + i] + d[i]) & 0xFF for i in range(length))
+            pos += 9 + length
+    assert len(out) == new_size
+    return bytes(out)
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit("usage: mkdelta.py OLD.bin NEW.bin OUT")
+    old = open(sys.argv[1], "rb").read()
+    new = open(sys.argv[2], "rb").read()
+
+    delta = encode(old, new, diff(old, new))
+    if apply(old, delta) != new:
+        sys.exit("delta does not reproduce the new image")
+    open(sys.argv[3], "wb").write(delta)
+
+    print(json.dumps({
+        "fromSize": len(old),
+        "fromSha256": hashlib.sha256(old).hexdigest(),
+        "size": len(delta),
+        "sha256": hashlib.sha256(delta).hexdigest(),
+    }, indent=2))
+    print("%d -> %d bytes (%.1f%% of the image)" % (len(new), len(delta), 100.0 * len(delta) / len(new)),
+          file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,106 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+#include "soilfilter.h"
+
+// Continuous (DMA) soil ADC acquisition.
+// The driver averages ADC_CONV_PER_FRAME conversions into one frame (1 kHz);
+// the frame-done ISR only wakes adc_task, which feeds the median/IIR filter
+// and publishes a new soil value at ADC_OUTPUT_HZ. readSensors() just loads it.
+
+#define ADC_SAMPLE_HZ       20000
+#define ADC_CONV_PER_FRAME  20
+#define ADC_OUTPUT_HZ       100
+#define ADC_TASK_PRIO       4     // just below the control task
+#define ADC_TASK_CORE       1
+#define ADC_FRESH_MS        100   // an older soil value counts as stale
+
+extern Config cfg;
+
+static SoilFilter g_adcFilter;
+static TaskHandle_t g_adcTask = nullptr;
+static bool g_adcContinuous = false;
+
+static volatile int g_adcSoil = 0;
+static volatile uint32_t g_adcSoilMs = 0;    // when a soil value was last produced
+static volatile uint32_t g_adcRateHz = 0;    // measured conversions per second
+static volatile uint32_t g_adcNoiseVar = 0;  // variance of raw frames, counts^2
+
+static void ARDUINO_ISR_ATTR adc_onFrame() {
+  BaseType_t woken = pdFALSE;
+  if (g_adcTask) vTaskNotifyGiveFromISR(g_adcTask, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+static void adc_task(void*) {
+  const uint32_t framesPerOutput = (ADC_SAMPLE_HZ / ADC_CONV_PER_FRAME) / ADC_OUTPUT_HZ;
+  uint32_t sinceOutput = 0;
+  uint32_t frames = 0;
+  uint32_t rateStartMs = millis();
+
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+
+    if (g_adcFilter.medianN != cfg.adcMedianN || g_adcFilter.iirPct != cfg.adcIirPct) {
+      soilfilter_configure(g_adcFilter, cfg.adcMedianN, cfg.adcIirPct);
+    }
+
+    adc_continuous_data_t* data = nullptr;
+    while (analogContinuousRead(&data, 0)) {
+      soilfilter_push(g_adcFilter, data[0].avg_read_raw);
+      frames++;
+      if (++sinceOutput >= framesPerOutput) {
+        sinceOutput = 0;
+        g_adcSoil = soilfilter_output(g_adcFilter);
+        g_adcSoilMs = millis();
+      }
+    }
+
+    uint32_t now = millis();
+    if (now - rateStartMs >= 1000) {
+      g_adcRateHz = (uint32_t)((uint64_t)frames * ADC_CONV_PER_FRAME * 1000 / (now - rateStartMs));
+      g_adcNoiseVar = (uint32_t)g_adcFilter.var;
+      frames = 0;
+      rateStartMs = now;
+    }
+  }
+}
+
+// Falls back to one analogRead() per control cycle if the driver won't start
+static bool adc_begin(uint8_t pin) {
+  soilfilter_configure(g_adcFilter, cfg.adcMedianN, cfg.adcIirPct);
+
+  uint8_t pins[] = {pin};
+  analogContinuousSetWidth(12);
+  analogContinuousSetAtten(ADC_11db);
+  if (!analogContinuous(pins, 1, ADC_CONV_PER_FRAME, ADC_SAMPLE_HZ, &adc_onFrame)) {
+    Serial.println("[ADC] continuous mode failed, using analogRead");
+    return false;
+  }
+
+  if (!analogContinuousStart()) {
+    Serial.println("[ADC] start failed, using analogRead");
+    return false;
+  }
+  xTaskCreatePinnedToCore(adc_task, "adc", 3072, nullptr, ADC_TASK_PRIO, &g_adcTask, ADC_TASK_CORE);
+
+  g_adcContinuous = true;
+  Serial.printf("[ADC] continuous %d Hz, %d conv/frame\n", ADC_SAMPLE_HZ, ADC_CONV_PER_FRAME);
+  return true;
+}
+
+static int adc_soil(uint8_t pin) {
+  if (g_adcContinuous) return g_adcSoil;
+  int v = analogRead(pin);
+  g_adcSoilMs = millis();
+  return v;
+}
+
+// True while soil values keep coming, on either acquisition path
+static bool adc_soilFresh() {
+  uint32_t at = g_adcSoilMs;
+  return at != 0 && millis() - at <= ADC_FRESH_MS;
+}
+
+static uint32_t adc_sampleRateHz() { return g_adcRateHz; }
+static uint32_t adc_noiseVar() { return g_adcNoiseVar; }
@@ -0,0 +1,3 @@
+-DCONFIG_ASYNC_TCP_RUNNING_CORE=0
+-DCONFIG_ASYNC_TCP_PRIORITY=3
+-DCONFIG_ASYNC_TCP_STACK_SIZE=8192
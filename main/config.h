@@ -2,6 +2,11 @@
 #include <Arduino.h>
 
 #define HIST_LEN 240  // ~240 minta (ha 10s log: 40 perc)
+#define HIST_MIN_LEN  1440  // 1 min rollups: 24 h
+#define HIST_HOUR_LEN 720   // 1 h rollups: 30 days
+
+#define HIST_MIN_PERIOD_MS  60000UL
+#define HIST_HOUR_PERIOD_MS 3600000UL
 
 enum PumpMode : uint8_t {
   PUMP_OFF  = 0,
@@ -17,6 +22,7 @@ struct Config {
   // pump behavior
   int pumpPwm = 180;     // 0..255
   bool softRamp = true;  // ramp-up to PWM
+  uint32_t rampMs = 2000; // soft-ramp duration
 
   // minimum on/off times to prevent chattering
   uint32_t minOnMs  = 5000;
@@ -26,6 +32,10 @@ struct Config {
   uint32_t limitWindowSec     = 600; // 10 min
   uint32_t maxOnSecInWindow   = 60;  // max 60s ON in 10 min
 
+  // soil ADC filtering (continuous ADC, 1 kHz frames)
+  int adcMedianN = 7;   // median window in frames (odd, 1..15)
+  int adcIirPct = 25;   // weight of each new median, % (100 = no smoothing)
+
   // logging
   uint32_t logPeriodMs = 10000;
 
@@ -38,21 +48,64 @@ struct Runtime {
   int16_t tempC_x10 = 0;
   uint8_t cpuPct = 0;
 
+  uint32_t adcSampleHz = 0;   // raw soil ADC conversions per second
+  uint32_t adcNoiseVar = 0;   // variance of raw soil frames (counts^2)
+
   bool pumpOn = false;
   bool lockout = false;
+  uint8_t pumpDuty = 0;   // current EN1 PWM duty (0..255)
+  uint8_t rampPct = 0;    // soft-ramp progress, 100 = at full duty
 
   uint32_t lastPumpChangeMs = 0;
   uint32_t windowStartMs = 0;
   uint32_t onTimeThisWindowMs = 0;
 
-  uint32_t lastLogMs = 0;
   uint32_t lastCpuMs = 0;
 };
 
+// One bucket of a rollup tier
+struct HistRollup {
+  int16_t soilMin;
+  int16_t soilMax;
+  int16_t soilMean;
+  int16_t tempC_x10;  // mean
+  uint8_t cpuPct;     // mean
+  uint8_t pumpPct;    // share of samples with the pump on
+};
+
+// Running sums of the bucket being filled
+struct HistAcc {
+  int32_t soilSum = 0;
+  int32_t tempSum = 0;
+  uint32_t cpuSum = 0;
+  int16_t soilMin = 0;
+  int16_t soilMax = 0;
+  uint16_t n = 0;
+  uint16_t pumpN = 0;
+  uint32_t startMs = 0;
+};
+
+template <uint16_t N>
+struct HistTier {
+  HistRollup buf[N];
+  uint16_t idx = 0;
+  bool filled = false;
+  HistAcc acc;          // not persisted
+  uint32_t lastMs = 0;  // bucket start of the newest entry, not persisted
+  uint32_t seq = 0;     // entries added since boot (incl. loaded ones), not persisted
+};
+
 struct Histories {
+  // raw samples at logPeriodMs
   int16_t soil[HIST_LEN];
   int16_t tempC_x10[HIST_LEN];
   uint8_t cpuPct[HIST_LEN];
   uint16_t idx = 0;
   bool filled = false;
+  uint32_t lastMs = 0;  // millis() of the newest sample, not persisted
+  uint32_t seq = 0;     // sequence number of the newest sample, not persisted
+
+  // rollups, filled from the same samples (history.h)
+  HistTier<HIST_MIN_LEN> minute;
+  HistTier<HIST_HOUR_LEN> hour;
 };
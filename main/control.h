@@ -0,0 +1,141 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+#include "pump.h"
+#include "history.h"
+
+// Control loop: sensors, pump and history. Only talks to the hardware through
+// the Arduino API, pump.h and adc_* / metrics_* / storage_* calls, so it also builds on the host
+// (see sim/).
+
+// Hardware pins
+#define SOIL_PIN     34   // ADC input for soil moisture sensor (motor pins: pump.h)
+
+extern Config cfg;
+extern Runtime rt;
+extern Histories hist;
+
+// ---- Sensor reading ----
+static void readSensors() {
+  // Filtered soil moisture from the continuous ADC pipeline (adc.h)
+  rt.soilNow = adc_soil(SOIL_PIN);
+  rt.adcSampleHz = adc_sampleRateHz();
+  rt.adcNoiseVar = adc_noiseVar();
+
+  // Read internal temperature sensor
+  rt.tempC_x10 = (int16_t)(temperatureRead() * 10);
+
+  // CPU load averaged over both cores (metrics.h, idle-task run time)
+  rt.cpuPct = metrics_cpuPct();
+}
+
+// ---- Pump control with hysteresis and safety limits ----
+static void controlPump() {
+  uint32_t now = millis();
+
+  // Reset window if expired
+  if (now - rt.windowStartMs >= cfg.limitWindowSec * 1000UL) {
+    rt.windowStartMs = now;
+    rt.onTimeThisWindowMs = 0;
+    rt.lockout = false;
+  }
+
+  bool shouldBeOn = false;
+
+  // Determine desired pump state based on mode
+  if (cfg.mode == PUMP_ON) {
+    shouldBeOn = true;
+  } else if (cfg.mode == PUMP_AUTO) {
+    // Hysteresis logic
+    if (rt.pumpOn) {
+      // Pump is ON: stay on until soil is wet enough
+      shouldBeOn = (rt.soilNow >= cfg.wetOff);
+    } else {
+      // Pump is OFF: turn on only when soil is dry enough
+      shouldBeOn = (rt.soilNow >= cfg.dryOn);
+    }
+  }
+  // PUMP_OFF mode: shouldBeOn stays false
+
+  // Apply safety limits
+  if (shouldBeOn) {
+    // Check max on-time in window
+    if (rt.onTimeThisWindowMs >= cfg.maxOnSecInWindow * 1000UL) {
+      shouldBeOn = false;
+      rt.lockout = true;
+    }
+    // Check min off time (prevent turning on too soon after turning off)
+    if (!rt.pumpOn && (now - rt.lastPumpChangeMs < cfg.minOffMs)) {
+      shouldBeOn = false;
+    }
+  } else {
+    // Check min on time (prevent turning off too soon after turning on)
+    if (rt.pumpOn && (now - rt.lastPumpChangeMs < cfg.minOnMs)) {
+      shouldBeOn = true;
+    }
+  }
+
+  // Apply pump state change
+  if (shouldBeOn && !rt.pumpOn) {
+    // Turn pump ON (forward direction)
+    rt.pumpOn = true;
+    rt.lastPumpChangeMs = now;
+
+    pump_start((uint8_t)cfg.pumpPwm, cfg.softRamp ? cfg.rampMs : 0);
+    Serial.println("[PUMP] ON");
+
+  } else if (!shouldBeOn && rt.pumpOn) {
+    // Turn pump OFF
+    rt.pumpOn = false;
+    rt.lastPumpChangeMs = now;
+    pump_stop();
+    Serial.println("[PUMP] OFF");
+
+  } else if (rt.pumpOn) {
+    // Follow pumpPwm changes made while running
+    pump_setDuty((uint8_t)cfg.pumpPwm);
+  }
+  pump_tick();
+
+  rt.pumpDuty = pump_duty();
+  rt.rampPct = pump_rampPct();
+
+  // Track on-time within window
+  static uint32_t lastLoopMs = 0;
+  if (rt.pumpOn && lastLoopMs > 0) {
+    rt.onTimeThisWindowMs += (now - lastLoopMs);
+  }
+  lastLoopMs = now;
+}
+
+// ---- History and logging ----
+// Runs on the storage task from a snapshot of the control task's Runtime.
+static void updateHistoryAndLog(const Runtime& r) {
+  uint32_t now = millis();
+  static uint32_t lastLogMs = now;
+
+  if (now - lastLogMs < cfg.logPeriodMs) return;
+  lastLogMs = now;
+
+  // Raw ring + minute/hour rollups
+  uint8_t closed = history_add(hist, r, now);
+
+  // Append to log file
+  storage_appendLog(r);
+
+  // Periodically save history to SD: raw every 10 log entries, the minute
+  // tier every 10 rollups, the hour tier on every rollup
+  static uint8_t saveCounter = 0;
+  static uint8_t minuteCounter = 0;
+  uint8_t save = 0;
+  if (++saveCounter >= 10) {
+    saveCounter = 0;
+    save |= HIST_TIER_RAW;
+  }
+  if ((closed & HIST_TIER_MIN) && ++minuteCounter >= 10) {
+    minuteCounter = 0;
+    save |= HIST_TIER_MIN;
+  }
+  save |= closed & HIST_TIER_HOUR;
+  if (save) storage_saveHistory(hist, save);
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <ESPAsyncWebServer.h>
+
+// Server-Sent Events for GET /api/events.
+//
+// AsyncEventSource keeps the connections and queues frames per client; a
+// client that stops reading has its queue capped by the library and frames
+// are dropped rather than buffered without bound. Past EVT_MAX_CLIENTS new
+// subscribers are refused and the UI keeps polling.
+
+#define EVT_MAX_CLIENTS  6
+#define EVT_RETRY_MS     3000   // reconnect delay suggested to browsers
+
+static AsyncEventSource g_events("/api/events");
+static volatile bool g_evtNewClient = false;  // send a frame right away
+
+static uint8_t events_clientCount() {
+  return (uint8_t)g_events.count();
+}
+
+static void events_begin(AsyncWebServer& server) {
+  g_events.setFilter([](AsyncWebServerRequest*) {
+    return g_events.count() < EVT_MAX_CLIENTS;
+  });
+  g_events.onConnect([](AsyncEventSourceClient* client) {
+    client->send("hello", "hello", 0, EVT_RETRY_MS);  // sets the retry delay
+    g_evtNewClient = true;
+    Serial.printf("[WEB] event subscriber (%u total)\n", (unsigned)g_events.count());
+  });
+  server.addHandler(&g_events);
+}
+
+// Sends "event: <event>\ndata: <data>\n\n" to every subscriber
+static void events_broadcast(const char* event, const char* data) {
+  g_events.send(data, event);
+}
+
+static void events_stop() {
+  g_events.close();
+}
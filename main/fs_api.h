@@ -1,9 +1,65 @@
 #pragma once
-#include <WebServer.h>
+#include <ESPAsyncWebServer.h>
 #include <SdFat.h>
+#include <esp_rom_crc.h>
+#include <mbedtls/sha256.h>
+#include <memory>
+#include <new>
+#include "metrics.h"
+#include "webcache.h"
 
 extern SdFat sd;
 
+// ---- Handler plumbing
+// Handlers run in the async_tcp task, next to the storage task: each holds
+// the card for its whole run, or answers 503 if it stays busy too long.
+#define WEB_LOCK_WAIT_MS  2000
+
+typedef void (*WebHandler)(AsyncWebServerRequest* req);
+
+static ArRequestHandlerFunction web_locked(WebHandler handler) {
+  return [handler](AsyncWebServerRequest* req) {
+    if (!storage_lock(pdMS_TO_TICKS(WEB_LOCK_WAIT_MS))) {
+      req->send(503, "text/plain", "SD busy");
+      return;
+    }
+    uint32_t t0 = micros();
+    handler(req);
+    metrics_record(MET_WEB, micros() - t0);
+    storage_unlock();
+  };
+}
+
+// An open file owned by a streaming response; closed when the response is
+// done or the client goes away
+struct FsStream {
+  FsFile f;
+  ~FsStream() {
+    storage_lock();
+    f.close();
+    storage_unlock();
+  }
+};
+
+// Response streaming an SD file a piece at a time (each piece under the
+// lock); nullptr if it cannot be opened. Call with the lock held.
+static AsyncWebServerResponse* fs_fileResponse(AsyncWebServerRequest* req, const char* path,
+                                               const char* contentType) {
+  std::shared_ptr<FsStream> st = std::make_shared<FsStream>();
+  st->f = sd.open(path, O_RDONLY);
+  if (!st->f || st->f.isDirectory()) return nullptr;
+
+  return req->beginResponse(contentType, st->f.size(),
+    [st](uint8_t* buf, size_t maxLen, size_t) -> size_t {
+      if (!storage_lock(pdMS_TO_TICKS(WEB_LOCK_WAIT_MS))) return RESPONSE_TRY_AGAIN;
+      uint32_t t0 = micros();
+      int n = st->f.read(buf, maxLen);
+      metrics_record(MET_WEB, micros() - t0);
+      storage_unlock();
+      return n > 0 ? (size_t)n : 0;
+    });
+}
+
 // JSON escape function to prevent injection
 static String jsonEscape(const String& s) {
   String out;
@@ -49,19 +105,19 @@ static String sanitizePath(const String& path) {
   return clean;
 }
 
-static void fs_handleList(WebServer& srv) {
-  if (!srv.hasArg("path")) {
-    srv.send(400, "application/json", "{\"error\":\"missing path parameter\"}");
+static void fs_handleList(AsyncWebServerRequest* srv) {
+  if (!srv->hasArg("path")) {
+    srv->send(400, "application/json", "{\"error\":\"missing path parameter\"}");
     return;
   }
 
-  String rawPath = srv.arg("path");
+  String rawPath = srv->arg("path");
   String path = sanitizePath(rawPath);
 
   FsFile dir = sd.open(path.c_str());
   if (!dir || !dir.isDirectory()) {
     dir.close();
-    srv.send(404, "application/json", "{\"error\":\"not a directory\"}");
+    srv->send(404, "application/json", "{\"error\":\"not a directory\"}");
     return;
   }
 
@@ -106,73 +162,64 @@ static void fs_handleList(WebServer& srv) {
   // Close JSON array and object
   pos += snprintf(json + pos, sizeof(json) - pos, "]}");
 
-  srv.send(200, "application/json", json);
+  srv->send(200, "application/json", json);
 }
 
 // Download file - streams in chunks for large files
-static void fs_handleDownload(WebServer& srv) {
-  if (!srv.hasArg("path")) {
-    srv.send(400, "text/plain", "missing path");
+static void fs_handleDownload(AsyncWebServerRequest* srv) {
+  if (!srv->hasArg("path")) {
+    srv->send(400, "text/plain", "missing path");
     return;
   }
 
-  String path = sanitizePath(srv.arg("path"));
-  FsFile f = sd.open(path.c_str(), O_RDONLY);
-  if (!f || f.isDirectory()) {
-    if (f) f.close();
-    srv.send(404, "text/plain", "file not found");
+  String path = sanitizePath(srv->arg("path"));
+  AsyncWebServerResponse* res = fs_fileResponse(srv, path.c_str(), "application/octet-stream");
+  if (!res) {
+    srv->send(404, "text/plain", "file not found");
     return;
   }
 
-  size_t fileSize = f.size();
   String filename = path.substring(path.lastIndexOf('/') + 1);
+  res->addHeader("Content-Disposition", "attachment; filename=\"" + filename + "\"");
+  srv->send(res);
+}
 
-  // Set headers for download
-  srv.sendHeader("Content-Disposition", "attachment; filename=\"" + filename + "\"");
-  srv.setContentLength(fileSize);
-  srv.send(200, "application/octet-stream", "");
-
-  // Stream file in chunks
-  WiFiClient client = srv.client();
-  uint8_t buf[1024];
-  size_t sent = 0;
-
-  while (sent < fileSize && f.available()) {
-    size_t toRead = min((size_t)sizeof(buf), fileSize - sent);
-    size_t n = f.read(buf, toRead);
-    if (n == 0) break;
-    client.write(buf, n);
-    sent += n;
-    delay(1);  // Yield to prevent watchdog
-  }
-
-  f.close();
+// Uploads and deletes under /web bypass the UI's versioning
+static void fs_webFilesChanged(const String& path) {
+  if (!path.startsWith("/web/")) return;
+  storage_forgetWebuiVersion();
+  webcache_clear();
 }
 
 // Delete file or empty directory
-static void fs_handleDelete(WebServer& srv) {
-  if (!srv.hasArg("path")) {
-    srv.send(400, "application/json", "{\"error\":\"missing path\"}");
+static void fs_handleDelete(AsyncWebServerRequest* srv) {
+  if (!srv->hasArg("path")) {
+    srv->send(400, "application/json", "{\"error\":\"missing path\"}");
     return;
   }
 
-  String path = sanitizePath(srv.arg("path"));
+  String path = sanitizePath(srv->arg("path"));
 
   // Prevent deleting critical files
   if (path == "/" || path == "/web" || path == "/cfg.txt") {
-    srv.send(403, "application/json", "{\"error\":\"cannot delete protected path\"}");
+    srv->send(403, "application/json", "{\"error\":\"cannot delete protected path\"}");
     return;
   }
 
   if (!sd.exists(path.c_str())) {
-    srv.send(404, "application/json", "{\"error\":\"not found\"}");
+    srv->send(404, "application/json", "{\"error\":\"not found\"}");
     return;
   }
 
+  // The log writer keeps its file open; release it first
+  if (path.startsWith(LOG_DIR)) storage_closeLog();
+
   FsFile f = sd.open(path.c_str());
   bool isDir = f.isDirectory();
   f.close();
 
+  fs_webFilesChanged(path);
+
   bool ok;
   if (isDir) {
     ok = sd.rmdir(path.c_str());
@@ -181,82 +228,172 @@ static void fs_handleDelete(WebServer& srv) {
   }
 
   if (ok) {
-    srv.send(200, "application/json", "{\"ok\":true}");
+    srv->send(200, "application/json", "{\"ok\":true}");
   } else {
-    srv.send(500, "application/json", "{\"error\":\"delete failed\"}");
+    srv->send(500, "application/json", "{\"error\":\"delete failed\"}");
   }
 }
 
-// Upload file (supports chunked uploads)
-static void fs_handleUpload(WebServer& srv) {
-  if (!srv.hasArg("path")) {
-    srv.send(400, "application/json", "{\"error\":\"missing path\"}");
+// Upload a file as the raw request body (application/octet-stream), in one
+// request of any size. The body is gathered into FS_UPLOAD_BLOCK pieces and
+// each goes to the card under the lock as it fills, so an upload costs one
+// block of RAM whatever the file size. The file is written as <path>.part
+// and renamed over <path> only once all of it is on the card: an upload cut
+// short leaves the old file alone. With append=1 the body goes straight to
+// the end of <path> instead. The reply gives the size, CRC-32 (checkable by
+// the browser, which has no WebCrypto over plain HTTP) and SHA-256 (as in
+// firmware.json) of what was received.
+#define FS_UPLOAD_BLOCK  4096  // a sector multiple, like DL_BLOCK
+
+struct FsUpload {
+  FsFile f;
+  bool ok;
+  bool done;
+  bool append;
+  uint32_t size;  // bytes received
+  uint32_t crc;
+  mbedtls_sha256_context sha;
+  uint8_t digest[32];
+  size_t fill;    // bytes in block not yet on the card
+  uint8_t block[FS_UPLOAD_BLOCK];
+};
+
+static void fs_uploadFlush(FsUpload* up) {
+  if (!up->fill) return;
+  if (!storage_lock(pdMS_TO_TICKS(WEB_LOCK_WAIT_MS))) {
+    up->ok = false;
     return;
   }
+  uint32_t t0 = micros();
+  if (up->f.write(up->block, up->fill) != up->fill) up->ok = false;
+  metrics_record(MET_WEB, micros() - t0);
+  storage_unlock();
+  up->fill = 0;
+}
 
-  String path = sanitizePath(srv.arg("path"));
-  bool append = srv.hasArg("append") && srv.arg("append") == "1";
+// Last piece received (complete) or client gone: close, then keep or drop
+static void fs_uploadFinish(AsyncWebServerRequest* srv, FsUpload* up, bool complete) {
+  if (up->done) return;
+  up->done = true;
+  if (complete) fs_uploadFlush(up);
+  up->ok = up->ok && complete;
+
+  String path = sanitizePath(srv->arg("path"));
+  String part = path + ".part";
+  storage_lock();
+  if (up->f) up->f.close();
+  if (!up->append) {
+    if (up->ok) {
+      if (sd.exists(path.c_str())) sd.remove(path.c_str());
+      up->ok = sd.rename(part.c_str(), path.c_str());
+    }
+    if (!up->ok) sd.remove(part.c_str());
+  }
+  storage_unlock();
 
-  // Get raw body data
-  if (srv.hasArg("plain")) {
-    String body = srv.arg("plain");
+  mbedtls_sha256_finish(&up->sha, up->digest);
+  mbedtls_sha256_free(&up->sha);
+  Serial.printf("[WEB] upload %s: %lu bytes%s\n", path.c_str(), (unsigned long)up->size, up->ok ? "" : ", failed");
+}
 
-    FsFile f = sd.open(path.c_str(), append ? (O_WRITE | O_CREAT | O_APPEND) : (O_WRITE | O_CREAT | O_TRUNC));
-    if (!f) {
-      srv.send(500, "application/json", "{\"error\":\"cannot open file\"}");
-      return;
+static FsUpload* fs_uploadBegin(AsyncWebServerRequest* srv) {
+  // The request frees this with free(): FsFile holds no heap of its own,
+  // and fs_uploadFinish closes it first
+  void* mem = calloc(1, sizeof(FsUpload));
+  if (!mem) return nullptr;
+  FsUpload* up = new (mem) FsUpload();
+  srv->_tempObject = up;
+  mbedtls_sha256_init(&up->sha);
+  mbedtls_sha256_starts(&up->sha, 0);
+  srv->onDisconnect([srv, up]() { fs_uploadFinish(srv, up, false); });
+
+  String path = sanitizePath(srv->arg("path"));
+  up->append = srv->hasArg("append") && srv->arg("append") == "1";
+
+  if (!storage_lock(pdMS_TO_TICKS(WEB_LOCK_WAIT_MS))) return up;  // ok stays false
+  if (path.startsWith(LOG_DIR)) storage_closeLog();
+  fs_webFilesChanged(path);
+  if (up->append) up->f = sd.open(path.c_str(), O_WRITE | O_CREAT | O_APPEND);
+  else up->f = sd.open((path + ".part").c_str(), O_WRITE | O_CREAT | O_TRUNC);
+  up->ok = (bool)up->f;
+  storage_unlock();
+  return up;
+}
+
+static void fs_handleUploadBody(AsyncWebServerRequest* srv, uint8_t* data, size_t len,
+                                size_t index, size_t total) {
+  if (!srv->hasArg("path")) return;
+  FsUpload* up = index == 0 ? fs_uploadBegin(srv) : (FsUpload*)srv->_tempObject;
+  if (!up || up->done) return;
+
+  // A failed upload still takes in the rest of the body, then answers 500
+  if (up->ok) {
+    up->crc = esp_rom_crc32_le(up->crc, data, len);
+    mbedtls_sha256_update(&up->sha, data, len);
+    up->size += len;
+    for (size_t off = 0; off < len && up->ok;) {
+      size_t n = min(FS_UPLOAD_BLOCK - up->fill, len - off);
+      memcpy(up->block + up->fill, data + off, n);
+      up->fill += n;
+      off += n;
+      if (up->fill == FS_UPLOAD_BLOCK) fs_uploadFlush(up);
     }
+  }
+  if (index + len >= total) fs_uploadFinish(srv, up, true);
+}
 
-    f.write((const uint8_t*)body.c_str(), body.length());
-    size_t sz = f.size();
-    f.close();
+static void fs_handleUpload(AsyncWebServerRequest* srv) {
+  if (!srv->hasArg("path")) {
+    srv->send(400, "application/json", "{\"error\":\"missing path\"}");
+    return;
+  }
 
-    char json[64];
-    snprintf(json, sizeof(json), "{\"ok\":true,\"size\":%lu}", (unsigned long)sz);
-    srv.send(200, "application/json", json);
+  FsUpload* up = (FsUpload*)srv->_tempObject;
+  if (!up && srv->contentLength() == 0) {
+    // An empty body never reaches fs_handleUploadBody: create the file here
+    up = fs_uploadBegin(srv);
+    if (up) fs_uploadFinish(srv, up, true);
+  }
+  if (!up) {
+    srv->send(400, "application/json", "{\"error\":\"no data\"}");
+  } else if (!up->done || !up->ok) {
+    srv->send(500, "application/json", "{\"error\":\"cannot write file\"}");
   } else {
-    srv.send(400, "application/json", "{\"error\":\"no data\"}");
+    char sha[65];
+    char json[160];
+    storage_shaHex(up->digest, sha);
+    snprintf(json, sizeof(json), "{\"ok\":true,\"size\":%lu,\"crc32\":\"%08lx\",\"sha256\":\"%s\"}",
+             (unsigned long)up->size, (unsigned long)up->crc, sha);
+    srv->send(200, "application/json", json);
   }
 }
 
 // Create directory
-static void fs_handleMkdir(WebServer& srv) {
-  if (!srv.hasArg("path")) {
-    srv.send(400, "application/json", "{\"error\":\"missing path\"}");
+static void fs_handleMkdir(AsyncWebServerRequest* srv) {
+  if (!srv->hasArg("path")) {
+    srv->send(400, "application/json", "{\"error\":\"missing path\"}");
     return;
   }
 
-  String path = sanitizePath(srv.arg("path"));
+  String path = sanitizePath(srv->arg("path"));
 
   if (sd.exists(path.c_str())) {
-    srv.send(409, "application/json", "{\"error\":\"already exists\"}");
+    srv->send(409, "application/json", "{\"error\":\"already exists\"}");
     return;
   }
 
   if (sd.mkdir(path.c_str())) {
-    srv.send(200, "application/json", "{\"ok\":true}");
+    srv->send(200, "application/json", "{\"ok\":true}");
   } else {
-    srv.send(500, "application/json", "{\"error\":\"mkdir failed\"}");
+    srv->send(500, "application/json", "{\"error\":\"mkdir failed\"}");
   }
 }
 
-static void fs_register(WebServer& srv) {
-  srv.on("/api/fs/list", HTTP_GET, [&]() {
-    fs_handleList(srv);
-  });
-  srv.on("/api/fs/download", HTTP_GET, [&]() {
-    fs_handleDownload(srv);
-  });
-  srv.on("/api/fs/delete", HTTP_POST, [&]() {
-    fs_handleDelete(srv);
-  });
-  srv.on("/api/fs/delete", HTTP_GET, [&]() {
-    fs_handleDelete(srv);  // Allow GET for easy testing
-  });
-  srv.on("/api/fs/upload", HTTP_POST, [&]() {
-    fs_handleUpload(srv);
-  });
-  srv.on("/api/fs/mkdir", HTTP_POST, [&]() {
-    fs_handleMkdir(srv);
-  });
+static void fs_register(AsyncWebServer& srv) {
+  srv.on("/api/fs/list", HTTP_GET, web_locked(fs_handleList));
+  srv.on("/api/fs/download", HTTP_GET, web_locked(fs_handleDownload));
+  srv.on("/api/fs/delete", HTTP_POST, web_locked(fs_handleDelete));
+  srv.on("/api/fs/delete", HTTP_GET, web_locked(fs_handleDelete));  // Allow GET for easy testing
+  srv.on("/api/fs/upload", HTTP_POST, fs_handleUpload, nullptr, fs_handleUploadBody);
+  srv.on("/api/fs/mkdir", HTTP_POST, web_locked(fs_handleMkdir));
 }
@@ -0,0 +1,136 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+
+// Tiered history: every logged sample goes into the raw ring and into the
+// open minute and hour buckets; a bucket is closed into its tier's ring when
+// the next sample falls past its period. Plain C++ (host simulator).
+
+#define HIST_TIER_RAW   0x01
+#define HIST_TIER_MIN   0x02
+#define HIST_TIER_HOUR  0x04
+
+static void history_accAdd(HistAcc& a, const Runtime& r, uint32_t now) {
+  int16_t soil = (int16_t)r.soilNow;
+  if (a.n == 0) {
+    a.startMs = now;
+    a.soilMin = soil;
+    a.soilMax = soil;
+  }
+  if (soil < a.soilMin) a.soilMin = soil;
+  if (soil > a.soilMax) a.soilMax = soil;
+  a.soilSum += soil;
+  a.tempSum += r.tempC_x10;
+  a.cpuSum += r.cpuPct;
+  if (r.pumpOn) a.pumpN++;
+  a.n++;
+}
+
+template <uint16_t N>
+static void history_close(HistTier<N>& t) {
+  HistAcc& a = t.acc;
+  HistRollup& v = t.buf[t.idx];
+  v.soilMin = a.soilMin;
+  v.soilMax = a.soilMax;
+  v.soilMean = (int16_t)(a.soilSum / a.n);
+  v.tempC_x10 = (int16_t)(a.tempSum / a.n);
+  v.cpuPct = (uint8_t)(a.cpuSum / a.n);
+  v.pumpPct = (uint8_t)(a.pumpN * 100U / a.n);
+  t.lastMs = a.startMs;
+  t.seq++;
+
+  t.idx = (t.idx + 1) % N;
+  if (t.idx == 0) t.filled = true;
+  a = HistAcc{};
+}
+
+// Returns the HIST_TIER_* bits of the tiers that gained an entry
+template <uint16_t N>
+static uint8_t history_feed(HistTier<N>& t, const Runtime& r, uint32_t now,
+                            uint32_t periodMs, uint8_t bit) {
+  uint8_t closed = 0;
+  if (t.acc.n > 0 && now - t.acc.startMs >= periodMs) {
+    history_close(t);
+    closed = bit;
+  }
+  history_accAdd(t.acc, r, now);
+  return closed;
+}
+
+static uint8_t history_add(Histories& h, const Runtime& r, uint32_t now) {
+  h.soil[h.idx] = r.soilNow;
+  h.tempC_x10[h.idx] = r.tempC_x10;
+  h.cpuPct[h.idx] = r.cpuPct;
+
+  h.idx = (h.idx + 1) % HIST_LEN;
+  if (h.idx == 0) h.filled = true;
+  h.lastMs = now;
+  h.seq++;
+
+  uint8_t closed = HIST_TIER_RAW;
+  closed |= history_feed(h.minute, r, now, HIST_MIN_PERIOD_MS, HIST_TIER_MIN);
+  closed |= history_feed(h.hour, r, now, HIST_HOUR_PERIOD_MS, HIST_TIER_HOUR);
+  return closed;
+}
+
+// ---- chronological access
+
+// Ring of size n with write position idx: slot of entry k, 0 = oldest
+static uint16_t history_slot(uint16_t idx, bool filled, uint16_t n, uint32_t k) {
+  return (uint16_t)(((filled ? idx : 0) + k) % n);
+}
+
+// Slot of sequence number s in a ring whose newest entry, newestSeq, sits
+// just before idx; valid while s is still in the ring
+static uint16_t history_slotOfSeq(uint16_t idx, uint16_t n, uint32_t newestSeq, uint32_t s) {
+  uint32_t back = (newestSeq - s) % n;
+  return (uint16_t)((idx + n - 1 - back) % n);
+}
+
+static uint16_t history_count(uint16_t idx, bool filled, uint16_t n) {
+  return filled ? n : idx;
+}
+
+// Entries from first to count-1 taking every step-th one so that the newest
+// is always included. Entries are periodMs apart and the newest is at time
+// newestMs; sinceMs keeps only those at or after that time (0 = all).
+struct HistRange {
+  uint32_t first;
+  uint32_t step;
+  uint32_t count;
+};
+
+static HistRange history_range(uint32_t count, uint32_t step, uint32_t periodMs,
+                               uint64_t newestMs, uint64_t sinceMs) {
+  HistRange r{0, step ? step : 1, count};
+  if (count == 0) return r;
+
+  if (sinceMs > 0) {
+    if (sinceMs > newestMs) {
+      r.first = count;  // nothing that recent
+      return r;
+    }
+    uint64_t keep = (newestMs - sinceMs) / periodMs + 1;
+    if (keep < count) r.first = count - (uint32_t)keep;
+  }
+  // align so (count - 1 - first) is a multiple of step
+  r.first += (count - 1 - r.first) % r.step;
+  return r;
+}
+
+// Entries with a sequence number above after; the newest has newestSeq.
+// Entries dropped from the ring since then are simply missing.
+static HistRange history_rangeAfter(uint32_t count, uint32_t step, uint32_t newestSeq,
+                                    uint32_t after) {
+  HistRange r{0, step ? step : 1, count};
+  if (count == 0) return r;
+
+  if (after >= newestSeq) {
+    r.first = count;
+    return r;
+  }
+  uint32_t fresh = newestSeq - after;
+  if (fresh < count) r.first = count - fresh;
+  r.first += (count - 1 - r.first) % r.step;
+  return r;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <Arduino.h>
+
+// RAM staging buffer for the SD log. Lines are appended here and written to
+// the card in batches that end on a sector boundary, or in full once the
+// oldest buffered byte is LOGBUF_MAX_AGE_MS old (or on a forced flush).
+// Plain C++ so the host simulator uses the same batching policy.
+
+#define LOGBUF_SIZE        4096
+#define LOGBUF_SECTOR      512
+#define LOGBUF_BATCH       2048     // write once this much is buffered...
+#define LOGBUF_MAX_AGE_MS  120000   // ...or the oldest line is this old
+
+struct LogBuf {
+  char data[LOGBUF_SIZE];
+  uint16_t len = 0;
+  uint32_t oldestMs = 0;   // when data[0] was buffered
+  uint32_t dropped = 0;    // lines lost because the buffer was full
+};
+
+static bool logbuf_append(LogBuf& b, const char* s, size_t n, uint32_t now) {
+  if (n > (size_t)(LOGBUF_SIZE - b.len)) {
+    b.dropped++;
+    return false;
+  }
+  if (b.len == 0) b.oldestMs = now;
+  memcpy(b.data + b.len, s, n);
+  b.len += n;
+  return true;
+}
+
+// Bytes to write now for a file currently at filePos (0 = not yet)
+static size_t logbuf_due(const LogBuf& b, uint32_t filePos, uint32_t now, bool force) {
+  if (b.len == 0) return 0;
+  if (force || now - b.oldestMs >= LOGBUF_MAX_AGE_MS) return b.len;
+  if (b.len < LOGBUF_BATCH) return 0;
+
+  // Largest prefix that leaves the file ending on a sector boundary
+  uint32_t end = (filePos + b.len) & ~(uint32_t)(LOGBUF_SECTOR - 1);
+  return end > filePos ? end - filePos : 0;
+}
+
+// The remainder keeps the old oldestMs: it can only be younger than that
+static void logbuf_consume(LogBuf& b, size_t n) {
+  if (n >= b.len) {
+    b.len = 0;
+    return;
+  }
+  memmove(b.data, b.data + n, b.len - n);
+  b.len -= n;
+}
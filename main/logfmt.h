@@ -0,0 +1,102 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+
+// Binary sensor log format.
+//
+//   /log/NNNNNNNN.bin  segment: LogSegHeader + LogRecord[]  (fixed 16-byte records,
+//                      32 per sector, so a record never straddles a sector)
+//   /log/index.bin     LogIndexEntry per segment, appended when a segment opens
+//                      and rewritten in place when it is sealed
+//
+// Records carry Unix time (0 until NTP has synced) and uptime. Epoch times only
+// grow within a segment, so a time range is found by binary search.
+// Plain C++ so the host simulator can exercise the same code.
+
+#define LOGSEG_MAGIC        0x474F4C49UL  // "ILOG"
+#define LOGSEG_VERSION      1
+#define LOGSEG_FLAG_SEALED  0x01
+#define LOGSEG_MAX_RECORDS  65536UL       // 1 MB segments (~7.5 days at 10 s)
+
+struct LogSegHeader {
+  uint32_t magic;
+  uint8_t  version;
+  uint8_t  recordSize;
+  uint8_t  flags;
+  uint8_t  rsv0;
+  uint32_t bootId;
+  uint32_t segNo;
+  uint32_t epochStart;   // Unix time when opened, 0 if not yet known
+  uint32_t msStart;      // millis() when opened
+  uint32_t recordCount;  // valid once sealed; otherwise derive from file size
+  uint32_t rsv1;
+};
+
+struct LogRecord {
+  uint32_t epoch;        // Unix seconds, 0 = clock not set yet
+  uint32_t uptimeS;      // seconds since boot
+  int16_t  soil;
+  int16_t  tempC_x10;
+  uint16_t onTimeWindowS;
+  uint8_t  cpuPct;
+  uint8_t  flags;        // LOGREC_PUMP_ON | LOGREC_LOCKOUT
+};
+
+#define LOGREC_PUMP_ON  0x01
+#define LOGREC_LOCKOUT  0x02
+
+struct LogIndexEntry {
+  uint32_t segNo;
+  uint32_t bootId;
+  uint32_t epochFirst;   // first non-zero record epoch (0 = none)
+  uint32_t epochLast;
+  uint32_t count;
+  uint8_t  flags;        // LOGSEG_FLAG_SEALED once final
+  uint8_t  rsv[3];
+};
+
+static_assert(sizeof(LogSegHeader) == 32, "LogSegHeader must stay 32 bytes");
+static_assert(sizeof(LogRecord) == 16, "LogRecord must stay 16 bytes");
+static_assert(sizeof(LogIndexEntry) == 24, "LogIndexEntry must stay 24 bytes");
+
+static const char* const LOGFMT_CSV_HEADER =
+  "epoch,uptimeS,soil,tempC_x10,cpuPct,pumpOn,lockout,onTimeWindowS\n";
+
+static LogRecord logfmt_record(const Runtime& rt, uint32_t epoch, uint32_t nowMs) {
+  LogRecord r{};
+  r.epoch = epoch;
+  r.uptimeS = nowMs / 1000;
+  r.soil = (int16_t)rt.soilNow;
+  r.tempC_x10 = rt.tempC_x10;
+  r.onTimeWindowS = (uint16_t)min(rt.onTimeThisWindowMs / 1000, (uint32_t)0xFFFF);
+  r.cpuPct = rt.cpuPct;
+  r.flags = (rt.pumpOn ? LOGREC_PUMP_ON : 0) | (rt.lockout ? LOGREC_LOCKOUT : 0);
+  return r;
+}
+
+static int logfmt_toCsv(const LogRecord& r, char* buf, size_t size) {
+  return snprintf(buf, size, "%lu,%lu,%d,%d,%u,%d,%d,%u\n",
+                  (unsigned long)r.epoch,
+                  (unsigned long)r.uptimeS,
+                  (int)r.soil,
+                  (int)r.tempC_x10,
+                  (unsigned)r.cpuPct,
+                  (r.flags & LOGREC_PUMP_ON) ? 1 : 0,
+                  (r.flags & LOGREC_LOCKOUT) ? 1 : 0,
+                  (unsigned)r.onTimeWindowS);
+}
+
+// First record index in [0, count) with epoch >= t (count if none).
+// read(i, rec) fetches record i; returns false on I/O error.
+template <typename ReadFn>
+static uint32_t logfmt_lowerBound(ReadFn read, uint32_t count, uint32_t t) {
+  uint32_t lo = 0, hi = count;
+  LogRecord r;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (!read(mid, r)) return count;
+    if (r.epoch < t) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
@@ -1,19 +1,26 @@
 #include <esp_task_wdt.h>
 #include "config.h"
+#include "shared.h"
 #include "credentials.h"
 #include "net.h"
 #include "storage.h"
 #include "ota.h"
 #include "web.h"
+#include "adc.h"
+#include "metrics.h"
+#include "control.h"
 
 // Watchdog timeout in seconds
 #define WDT_TIMEOUT_SEC 60
 
-// Hardware pins
-#define SOIL_PIN     34   // ADC input for soil moisture sensor
-#define EN1_PIN      13   // Motor driver enable (digital)
-#define IN1_PIN      14   // Motor driver input 1
-#define IN2_PIN      27   // Motor driver input 2
+// Task layout: pump control alone on the APP core at the highest priority,
+// everything that can stall (SD, TLS, HTTP) on the PRO core next to WiFi.
+#define CONTROL_PERIOD_MS   10
+#define CONTROL_TASK_PRIO   5
+#define STORAGE_TASK_PRIO   2
+#define NET_TASK_PRIO       1
+#define CONTROL_CORE        1
+#define SERVICE_CORE        0
 
 Config cfg;
 Runtime rt;
@@ -22,125 +29,101 @@ Histories hist;
 // Track if network services have been initialized
 static bool g_servicesStarted = false;
 
-// ---- Sensor reading ----
-static void readSensors() {
-  // Read soil moisture (ADC)
-  rt.soilNow = analogRead(SOIL_PIN);
+// ---- Control task: sensors + pump at a fixed period, never blocks on I/O
+static void controlTask(void*) {
+  esp_task_wdt_add(NULL);
+  TickType_t lastWake = xTaskGetTickCount();
+  uint32_t lastStartUs = micros();
 
-  // Read internal temperature sensor
-  rt.tempC_x10 = (int16_t)(temperatureRead() * 10);
+  for (;;) {
+    uint32_t t0 = micros();
+    metrics_recordPeriod(t0 - lastStartUs);
+    ota_healthTick(t0 - lastStartUs, adc_soilFresh());
+    lastStartUs = t0;
 
-  // CPU usage tracking (simplified - percentage of loop time)
-  static uint32_t loopCount = 0;
-  static uint32_t lastCpuCalc = 0;
-  loopCount++;
+    esp_task_wdt_reset();
 
-  if (millis() - lastCpuCalc >= 1000) {
-    // Rough estimate: assume 1000 loops/sec is 100% utilization
-    rt.cpuPct = min((uint8_t)100, (uint8_t)(loopCount / 10));
-    loopCount = 0;
-    lastCpuCalc = millis();
-  }
-}
+    Config next;
+    if (shared_takeConfig(next)) cfg = next;
 
-// ---- Pump control with hysteresis and safety limits ----
-static void controlPump() {
-  uint32_t now = millis();
+    readSensors();
+    uint32_t t1 = micros();
+    metrics_record(MET_SENSORS, t1 - t0);
 
-  // Reset window if expired
-  if (now - rt.windowStartMs >= cfg.limitWindowSec * 1000UL) {
-    rt.windowStartMs = now;
-    rt.onTimeThisWindowMs = 0;
-    rt.lockout = false;
-  }
+    controlPump();
+    metrics_record(MET_CONTROL, micros() - t1);
 
-  bool shouldBeOn = false;
-
-  // Determine desired pump state based on mode
-  if (cfg.mode == PUMP_ON) {
-    shouldBeOn = true;
-  } else if (cfg.mode == PUMP_AUTO) {
-    // Hysteresis logic
-    if (rt.pumpOn) {
-      // Pump is ON: stay on until soil is wet enough
-      shouldBeOn = (rt.soilNow >= cfg.wetOff);
-    } else {
-      // Pump is OFF: turn on only when soil is dry enough
-      shouldBeOn = (rt.soilNow >= cfg.dryOn);
-    }
+    shared_publishRuntime(rt);
+
+    vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(CONTROL_PERIOD_MS));
   }
-  // PUMP_OFF mode: shouldBeOn stays false
-
-  // Apply safety limits
-  if (shouldBeOn) {
-    // Check max on-time in window
-    if (rt.onTimeThisWindowMs >= cfg.maxOnSecInWindow * 1000UL) {
-      shouldBeOn = false;
-      rt.lockout = true;
-    }
-    // Check min off time (prevent turning on too soon after turning off)
-    if (!rt.pumpOn && (now - rt.lastPumpChangeMs < cfg.minOffMs)) {
-      shouldBeOn = false;
+}
+
+// ---- Storage task: history ring, log file and history blob
+static void storageTask(void*) {
+  esp_task_wdt_add(NULL);
+  Runtime snap;
+  uint32_t lastCpuSampleMs = 0;
+
+  for (;;) {
+    esp_task_wdt_reset();
+
+    // Web handlers may hold the card for a while; just try again next round
+    if (storage_lock(pdMS_TO_TICKS(100))) {
+      uint32_t t0 = micros();
+      shared_getRuntime(snap);
+      updateHistoryAndLog(snap);
+      storage_flushLog();  // age-based flush of the buffered log
+      metrics_record(MET_HISTORY, micros() - t0);
+      storage_unlock();
     }
-  } else {
-    // Check min on time (prevent turning off too soon after turning on)
-    if (rt.pumpOn && (now - rt.lastPumpChangeMs < cfg.minOnMs)) {
-      shouldBeOn = true;
+
+    if (millis() - lastCpuSampleMs >= 1000) {
+      lastCpuSampleMs = millis();
+      metrics_sampleCpu();
     }
-  }
 
-  // Apply pump state change
-  if (shouldBeOn && !rt.pumpOn) {
-    // Turn pump ON (forward direction)
-    rt.pumpOn = true;
-    rt.lastPumpChangeMs = now;
-
-    digitalWrite(IN1_PIN, LOW);
-    digitalWrite(IN2_PIN, HIGH);
-    digitalWrite(EN1_PIN, HIGH);
-    Serial.println("[PUMP] ON");
-
-  } else if (!shouldBeOn && rt.pumpOn) {
-    // Turn pump OFF
-    rt.pumpOn = false;
-    rt.lastPumpChangeMs = now;
-    digitalWrite(EN1_PIN, LOW);
-    digitalWrite(IN1_PIN, LOW);
-    digitalWrite(IN2_PIN, LOW);
-    Serial.println("[PUMP] OFF");
+    vTaskDelay(pdMS_TO_TICKS(100));
   }
+}
 
-  // Track on-time within window
-  static uint32_t lastLoopMs = 0;
-  if (rt.pumpOn && lastLoopMs > 0) {
-    rt.onTimeThisWindowMs += (now - lastLoopMs);
+// ---- Network events: start/stop services on WiFi transitions (net task)
+static void onNetEvent(NetEvent evt) {
+  if (evt == NET_EVT_UP) {
+    uisync_start(false);  // web UI check/update runs in the background
+    storage_lock();
+    ota_begin();
+    storage_unlock();
+    web_begin(&hist);
+    g_servicesStarted = true;
+  } else if (g_servicesStarted) {
+    storage_dlStop();  // a web UI sync or firmware download cannot go on
+    web_stop();
+    g_servicesStarted = false;
   }
-  lastLoopMs = now;
 }
 
-// ---- History and logging ----
-static void updateHistoryAndLog() {
-  uint32_t now = millis();
+// ---- Network task: WiFi state machine, status push, deferred web actions and OTA
+static void netTask(void*) {
+  esp_task_wdt_add(NULL);
 
-  if (now - rt.lastLogMs < cfg.logPeriodMs) return;
-  rt.lastLogMs = now;
+  for (;;) {
+    esp_task_wdt_reset();
 
-  // Update circular buffer
-  hist.soil[hist.idx] = rt.soilNow;
-  hist.tempC_x10[hist.idx] = rt.tempC_x10;
-  hist.cpuPct[hist.idx] = rt.cpuPct;
+    net_loop();
+    ota_healthCheck(g_servicesStarted);
 
-  hist.idx = (hist.idx + 1) % HIST_LEN;
-  if (hist.idx == 0) hist.filled = true;
+    if (g_servicesStarted) {
+      // Requests are served by the async_tcp task; handlers lock the card
+      // and record MET_WEB themselves
+      web_loop();
 
-  // Append to log file
-  storage_appendLog(rt);
+      uint32_t t1 = micros();
+      ota_loop();
+      metrics_record(MET_OTA, micros() - t1);
+    }
 
-  // Periodically save history to SD (every 10 log entries)
-  static uint8_t saveCounter = 0;
-  if (++saveCounter >= 10) {
-    saveCounter = 0;
-    storage_saveHistory(hist);
+    vTaskDelay(pdMS_TO_TICKS(2));
   }
 }
 
@@ -156,20 +139,16 @@ void setup() {
     .trigger_panic = true
   };
   esp_task_wdt_reconfigure(&wdt_config);
-  esp_task_wdt_add(NULL);  // Add current task to watchdog
+  esp_task_wdt_add(NULL);  // Watch setup() until the tasks take over
 
-  // Initialize motor driver pins
-  pinMode(EN1_PIN, OUTPUT);
-  pinMode(IN1_PIN, OUTPUT);
-  pinMode(IN2_PIN, OUTPUT);
-  digitalWrite(EN1_PIN, LOW);
-  digitalWrite(IN1_PIN, LOW);
-  digitalWrite(IN2_PIN, LOW);
+  // Initialize motor driver (direction pins + LEDC PWM on EN1, pump off)
+  pump_begin();
 
   // Initialize ADC
   analogReadResolution(12);  // 12-bit ADC (0-4095)
 
-  // Connect to WiFi
+  // Start connecting to WiFi (services come up on NET_EVT_UP)
+  net_onEvent(onNetEvent);
   net_begin(WIFI_SSID, WIFI_PASS);
 
   // Initialize SD card and load config/history
@@ -177,52 +156,26 @@ void setup() {
   storage_loadConfig(cfg);
   storage_validateConfig(cfg);
   storage_loadHistory(hist);
-  storage_ensureWebUI(net_isUp());
-
-  if (net_isUp()) {
-    ota_begin();
-    web_begin(&cfg, &rt, &hist);
-    g_servicesStarted = true;
-  }
+  storage_logBegin();
+  ota_healthBegin();
+  adc_begin(SOIL_PIN);
+  storage_ensureWebUI(false);
+  webcache_load(storage_webuiVersion());
 
   rt.windowStartMs = millis();
-  rt.lastLogMs = millis();
+  metrics_reset();
+  shared_begin(cfg);
+  shared_publishRuntime(rt);
+
+  xTaskCreatePinnedToCore(controlTask, "control", 4096, nullptr, CONTROL_TASK_PRIO, nullptr, CONTROL_CORE);
+  xTaskCreatePinnedToCore(storageTask, "storage", 6144, nullptr, STORAGE_TASK_PRIO, nullptr, SERVICE_CORE);
+  xTaskCreatePinnedToCore(netTask, "net", 12288, nullptr, NET_TASK_PRIO, nullptr, SERVICE_CORE);
 
   Serial.println("[SYS] ready");
 }
 
 void loop() {
-  // Feed watchdog
-  esp_task_wdt_reset();
-
-  // Core functionality
-  readSensors();
-  controlPump();
-  updateHistoryAndLog();
-
-  // Network services
-  if (net_isUp()) {
-    if (g_servicesStarted) {
-      web_loop();
-      ota_loop();
-    }
-  } else {
-    // Stop services when network goes down
-    if (g_servicesStarted) {
-      web_stop();
-      g_servicesStarted = false;
-    }
-
-    // Try to reconnect WiFi periodically
-    if (net_tryReconnect()) {
-      // Just reconnected - start OTA/web and check for webui updates
-      ota_begin();
-      web_begin(&cfg, &rt, &hist);
-      g_servicesStarted = true;
-      storage_ensureWebUI(true);
-    }
-  }
-
-  // Small delay to prevent tight loop
-  delay(10);
+  // All work happens in the tasks created by setup()
+  esp_task_wdt_delete(NULL);
+  vTaskDelete(NULL);
 }
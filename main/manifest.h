@@ -0,0 +1,244 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Typed view of firmware/firmware.json, shared by the web UI sync and the
+// firmware updater. It is filled by a streaming tokenizer: bytes are fed as
+// they arrive from the network and nothing of the document is kept, so a
+// parse costs this struct and the tokenizer state, with no allocation.
+// Unknown keys are skipped. Strings longer than their field are cut; a cut
+// URL or hash then fails its check downstream.
+
+#define MANIFEST_VERSION_LEN  16
+#define MANIFEST_URL_LEN      160
+#define MANIFEST_SHA_LEN      65   // hex + NUL
+#define MANIFEST_NAME_LEN     24
+#define MANIFEST_MAX_DELTAS   4
+#define MANIFEST_MAX_FILES    8
+#define MANIFEST_DEPTH        5    // firmware.deltas[i].key is the deepest path
+
+// A delta from an earlier release to firmware.version (see ota.h)
+struct ManifestDelta {
+  char     from[MANIFEST_VERSION_LEN];
+  uint32_t fromSize;                     // image it applies to
+  char     fromSha256[MANIFEST_SHA_LEN];
+  char     url[MANIFEST_URL_LEN];
+  uint32_t size;                         // of the delta file
+  char     sha256[MANIFEST_SHA_LEN];
+};
+
+struct ManifestFirmware {
+  char          version[MANIFEST_VERSION_LEN];
+  char          url[MANIFEST_URL_LEN];
+  uint32_t      size;                    // 0 if not listed
+  char          sha256[MANIFEST_SHA_LEN];  // "" if not listed
+  ManifestDelta deltas[MANIFEST_MAX_DELTAS];
+  uint8_t       deltaCount;
+};
+
+// One name from webui.files, with its hash from webui.sha256 if listed
+struct ManifestWebFile {
+  char     name[MANIFEST_NAME_LEN];
+  uint32_t size;
+  char     sha256[MANIFEST_SHA_LEN];
+};
+
+struct ManifestWebui {
+  char            version[MANIFEST_VERSION_LEN];
+  ManifestWebFile files[MANIFEST_MAX_FILES];
+  uint8_t         fileCount;
+};
+
+struct Manifest {
+  ManifestFirmware firmware;
+  ManifestWebui    webui;
+};
+
+// ---- Tokenizer
+// Tracks the path to the current value (object keys and array indexes) and
+// hands each scalar to manifest_onValue, which copies what it knows.
+struct JsonLevel {
+  bool    array;
+  uint8_t index;                   // element number in arrays
+  char    key[MANIFEST_NAME_LEN];  // current key in objects
+};
+
+struct JsonTok {
+  JsonLevel lv[MANIFEST_DEPTH];
+  uint8_t depth;      // open containers tracked in lv
+  uint8_t skip;       // containers open below MANIFEST_DEPTH, ignored
+  bool inString;
+  bool escape;
+  bool expectKey;     // the next string in an object is a key
+  bool error;
+  char tok[MANIFEST_URL_LEN];  // string or bare value (number, true, ...)
+  uint8_t len;
+};
+
+static void manifest_copy(char* dst, const char* src, size_t cap) {
+  strncpy(dst, src, cap - 1);
+  dst[cap - 1] = 0;
+}
+
+static void manifest_copySha(char* dst, const char* src) {
+  manifest_copy(dst, strlen(src) == 64 ? src : "", MANIFEST_SHA_LEN);
+}
+
+static ManifestWebFile* manifest_webFileSlot(Manifest& m, const char* name) {
+  ManifestWebui& w = m.webui;
+  for (uint8_t i = 0; i < w.fileCount; i++) {
+    if (!strcmp(w.files[i].name, name)) return &w.files[i];
+  }
+  if (w.fileCount >= MANIFEST_MAX_FILES) return nullptr;
+  ManifestWebFile* f = &w.files[w.fileCount++];
+  manifest_copy(f->name, name, sizeof(f->name));
+  return f;
+}
+
+static void manifest_onValue(Manifest& m, const JsonTok& t, const char* v) {
+  if (t.skip || t.depth < 2 || t.lv[t.depth - 1].array) return;
+  const char* section = t.lv[0].key;
+  const char* key = t.lv[t.depth - 1].key;
+
+  if (!strcmp(section, "firmware")) {
+    ManifestFirmware& fw = m.firmware;
+    if (t.depth == 2) {
+      if (!strcmp(key, "version")) manifest_copy(fw.version, v, sizeof(fw.version));
+      else if (!strcmp(key, "url")) manifest_copy(fw.url, v, sizeof(fw.url));
+      else if (!strcmp(key, "size")) fw.size = strtoul(v, nullptr, 10);
+      else if (!strcmp(key, "sha256")) manifest_copySha(fw.sha256, v);
+    } else if (t.depth == 4 && !strcmp(t.lv[1].key, "deltas") && t.lv[2].array &&
+               t.lv[2].index < MANIFEST_MAX_DELTAS) {
+      uint8_t i = t.lv[2].index;
+      ManifestDelta& d = fw.deltas[i];
+      if (i >= fw.deltaCount) fw.deltaCount = i + 1;
+      if (!strcmp(key, "from")) manifest_copy(d.from, v, sizeof(d.from));
+      else if (!strcmp(key, "fromSize")) d.fromSize = strtoul(v, nullptr, 10);
+      else if (!strcmp(key, "fromSha256")) manifest_copySha(d.fromSha256, v);
+      else if (!strcmp(key, "url")) manifest_copy(d.url, v, sizeof(d.url));
+      else if (!strcmp(key, "size")) d.size = strtoul(v, nullptr, 10);
+      else if (!strcmp(key, "sha256")) manifest_copySha(d.sha256, v);
+    }
+  } else if (!strcmp(section, "webui")) {
+    if (t.depth == 2 && !strcmp(key, "version")) {
+      manifest_copy(m.webui.version, v, sizeof(m.webui.version));
+    } else if (t.depth == 3 && (!strcmp(t.lv[1].key, "files") || !strcmp(t.lv[1].key, "sha256"))) {
+      ManifestWebFile* f = manifest_webFileSlot(m, key);
+      if (!f) return;
+      if (t.lv[1].key[0] == 'f') f->size = strtoul(v, nullptr, 10);
+      else manifest_copySha(f->sha256, v);
+    }
+  }
+}
+
+static void manifest_begin(JsonTok& t, Manifest& m) {
+  memset(&t, 0, sizeof(t));
+  memset(&m, 0, sizeof(m));
+}
+
+static void manifest_tokPush(JsonTok& t, char c) {
+  if (t.len < sizeof(t.tok) - 1) t.tok[t.len++] = c;
+}
+
+// A number, true, false or null ends at the next delimiter
+static void manifest_endBare(JsonTok& t, Manifest& m) {
+  if (!t.len) return;
+  t.tok[t.len] = 0;
+  manifest_onValue(m, t, t.tok);
+  t.len = 0;
+}
+
+static void manifest_feed(JsonTok& t, Manifest& m, char c) {
+  if (t.error) return;
+
+  if (t.inString) {
+    if (t.escape) {
+      t.escape = false;
+      manifest_tokPush(t, c);  // \" \\ \/ kept as the character itself
+    } else if (c == '\\') {
+      t.escape = true;
+    } else if (c == '"') {
+      t.inString = false;
+      t.tok[t.len] = 0;
+      t.len = 0;
+      bool inObject = t.depth && !t.lv[t.depth - 1].array;
+      if (inObject && t.expectKey) {
+        if (!t.skip) manifest_copy(t.lv[t.depth - 1].key, t.tok, MANIFEST_NAME_LEN);
+      } else {
+        manifest_onValue(m, t, t.tok);
+      }
+    } else {
+      manifest_tokPush(t, c);
+    }
+    return;
+  }
+
+  switch (c) {
+    case ' ': case '\t': case '\r': case '\n':
+      manifest_endBare(t, m);
+      break;
+    case '"':
+      manifest_endBare(t, m);
+      t.inString = true;
+      t.len = 0;
+      break;
+    case '{': case '[':
+      if (t.skip || t.depth >= MANIFEST_DEPTH) {
+        t.skip++;
+      } else {
+        JsonLevel& l = t.lv[t.depth++];
+        l.array = c == '[';
+        l.index = 0;
+        l.key[0] = 0;
+      }
+      t.expectKey = c == '{';
+      break;
+    case '}': case ']':
+      manifest_endBare(t, m);
+      if (t.skip) t.skip--;
+      else if (t.depth) t.depth--;
+      else t.error = true;
+      break;
+    case ':':
+      manifest_endBare(t, m);
+      t.expectKey = false;
+      break;
+    case ',':
+      manifest_endBare(t, m);
+      if (!t.skip && t.depth && t.lv[t.depth - 1].array) {
+        if (t.lv[t.depth - 1].index < 255) t.lv[t.depth - 1].index++;
+      } else {
+        t.expectKey = true;
+      }
+      break;
+    default:
+      manifest_tokPush(t, c);
+      break;
+  }
+}
+
+// True if the whole document was read and names a firmware version
+static bool manifest_end(JsonTok& t, Manifest& m) {
+  manifest_endBare(t, m);
+  return !t.error && !t.inString && t.depth == 0 && t.skip == 0 && m.firmware.version[0];
+}
+
+// ---- Lookups
+static const ManifestWebFile* manifest_webFile(const Manifest& m, const char* name) {
+  for (uint8_t i = 0; i < m.webui.fileCount; i++) {
+    if (!strcmp(m.webui.files[i].name, name)) return &m.webui.files[i];
+  }
+  return nullptr;
+}
+
+// The complete delta whose "from" is `version`, or nullptr
+static const ManifestDelta* manifest_delta(const ManifestFirmware& fw, const char* version) {
+  for (uint8_t i = 0; i < fw.deltaCount; i++) {
+    const ManifestDelta& d = fw.deltas[i];
+    if (strcmp(d.from, version) != 0) continue;
+    if (!d.url[0] || !d.size || !d.sha256[0] || !d.fromSize || !d.fromSha256[0]) return nullptr;
+    return &d;
+  }
+  return nullptr;
+}
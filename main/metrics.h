@@ -0,0 +1,165 @@
+#pragma once
+#include <Arduino.h>
+
+// Runtime instrumentation for /api/metrics:
+//  - per-core CPU load from FreeRTOS idle-task run time
+//  - execution time per subsystem (count / avg / max)
+//  - control task period histogram (p50 / p99 / max)
+//  - web UI asset cache hits / misses (webcache.h)
+// Each subsystem is recorded by exactly one task; readers tolerate tearing.
+
+enum MetricId : uint8_t {
+  MET_SENSORS = 0,
+  MET_CONTROL,
+  MET_HISTORY,
+  MET_WEB,
+  MET_OTA,
+  MET_COUNT
+};
+
+static const char* const METRIC_NAMES[MET_COUNT] = {
+  "sensors", "control", "history", "web", "ota"
+};
+
+struct MetricStat {
+  uint32_t count;
+  uint64_t totalUs;
+  uint32_t maxUs;
+};
+
+// Control period histogram: 100 us bins up to 25 ms, last bin = overflow
+#define MET_PERIOD_BIN_US  100
+#define MET_PERIOD_BINS    250
+
+static MetricStat g_metStats[MET_COUNT];
+static uint32_t g_metPeriodHist[MET_PERIOD_BINS];
+static uint32_t g_metPeriodCount = 0;
+static uint32_t g_metPeriodMaxUs = 0;
+static uint32_t g_metResetMs = 0;
+
+static volatile uint32_t g_metCacheHits = 0;
+static volatile uint32_t g_metCacheMisses = 0;
+
+static volatile uint8_t g_metCorePct[2] = {0, 0};
+static volatile uint8_t g_metCpuPct = 0;
+static volatile bool g_metCpuKnown = false;  // false without run-time stats
+
+static void metrics_record(MetricId id, uint32_t us) {
+  MetricStat& s = g_metStats[id];
+  s.count++;
+  s.totalUs += us;
+  if (us > s.maxUs) s.maxUs = us;
+}
+
+static void metrics_recordCache(bool hit) {
+  if (hit) g_metCacheHits++;
+  else g_metCacheMisses++;
+}
+
+static void metrics_recordPeriod(uint32_t us) {
+  uint32_t bin = us / MET_PERIOD_BIN_US;
+  if (bin >= MET_PERIOD_BINS) bin = MET_PERIOD_BINS - 1;
+  g_metPeriodHist[bin]++;
+  g_metPeriodCount++;
+  if (us > g_metPeriodMaxUs) g_metPeriodMaxUs = us;
+}
+
+// Upper edge of the bin holding the given percentile of control periods
+static uint32_t metrics_periodPercentileUs(uint8_t pct) {
+  uint32_t total = g_metPeriodCount;
+  if (total == 0) return 0;
+  uint32_t want = (uint32_t)(((uint64_t)total * pct + 99) / 100);
+  uint32_t seen = 0;
+  for (uint32_t i = 0; i < MET_PERIOD_BINS; i++) {
+    seen += g_metPeriodHist[i];
+    if (seen >= want) return min((i + 1) * MET_PERIOD_BIN_US, g_metPeriodMaxUs);
+  }
+  return g_metPeriodMaxUs;
+}
+
+static void metrics_reset() {
+  memset(g_metStats, 0, sizeof(g_metStats));
+  memset(g_metPeriodHist, 0, sizeof(g_metPeriodHist));
+  g_metPeriodCount = 0;
+  g_metPeriodMaxUs = 0;
+  g_metCacheHits = 0;
+  g_metCacheMisses = 0;
+  g_metResetMs = millis();
+}
+
+// Call about once a second from a service task: per-core load is the share
+// of run time the core's idle task did NOT get since the previous call.
+static void metrics_sampleCpu() {
+#if configGENERATE_RUN_TIME_STATS && configUSE_TRACE_FACILITY
+  static TaskStatus_t tasks[32];
+  static uint32_t lastIdle[2] = {0, 0};
+  static uint32_t lastTotal = 0;
+
+  uint32_t total = 0;
+  UBaseType_t n = uxTaskGetSystemState(tasks, 32, &total);
+  if (n == 0) return;  // more tasks than slots
+
+  uint32_t idle[2] = {0, 0};
+  for (UBaseType_t i = 0; i < n; i++) {
+    if (strncmp(tasks[i].pcTaskName, "IDLE", 4) != 0) continue;
+    BaseType_t core = tasks[i].xCoreID;
+    if (core == 0 || core == 1) idle[core] = tasks[i].ulRunTimeCounter;
+  }
+
+  uint32_t dTotal = total - lastTotal;
+  if (lastTotal != 0 && dTotal > 0) {
+    uint32_t sum = 0;
+    for (int c = 0; c < 2; c++) {
+      uint32_t dIdle = idle[c] - lastIdle[c];
+      uint32_t busy = dIdle >= dTotal ? 0 : 100 - (uint32_t)((uint64_t)dIdle * 100 / dTotal);
+      g_metCorePct[c] = (uint8_t)busy;
+      sum += busy;
+    }
+    g_metCpuPct = (uint8_t)(sum / 2);
+    g_metCpuKnown = true;
+  }
+  lastTotal = total;
+  lastIdle[0] = idle[0];
+  lastIdle[1] = idle[1];
+#endif
+}
+
+static uint8_t metrics_cpuPct() { return g_metCpuPct; }
+
+// False until a load has been measured, and always on builds without
+// FreeRTOS run-time stats; the JSON then reports -1 rather than 0 %
+static bool metrics_cpuKnown() { return g_metCpuKnown; }
+
+// Writes the /api/metrics JSON into buf; returns length
+static int metrics_toJson(char* buf, size_t size) {
+  uint32_t now = millis();
+  uint64_t elapsedUs = (uint64_t)(now - g_metResetMs) * 1000ULL;  // 32 bits wrap after 71 min
+  bool cpu = metrics_cpuKnown();
+  int pos = snprintf(buf, size,
+    "{\"uptimeMs\":%lu,\"windowMs\":%lu,\"cpuPct\":%d,\"corePct\":[%d,%d],\"subsys\":{",
+    (unsigned long)now, (unsigned long)(now - g_metResetMs),
+    cpu ? (int)g_metCpuPct : -1, cpu ? (int)g_metCorePct[0] : -1, cpu ? (int)g_metCorePct[1] : -1);
+
+  for (int i = 0; i < MET_COUNT && pos < (int)size; i++) {
+    const MetricStat& s = g_metStats[i];
+    uint32_t avg = s.count ? (uint32_t)(s.totalUs / s.count) : 0;
+    float pct = elapsedUs ? (float)((double)s.totalUs * 100.0 / elapsedUs) : 0.0f;
+    pos += snprintf(buf + pos, size - pos,
+      "%s\"%s\":{\"n\":%lu,\"avgUs\":%lu,\"maxUs\":%lu,\"pct\":%.2f}",
+      i ? "," : "", METRIC_NAMES[i],
+      (unsigned long)s.count, (unsigned long)avg, (unsigned long)s.maxUs, pct);
+  }
+
+  if (pos < (int)size) {
+    pos += snprintf(buf + pos, size - pos,
+      "},\"loop\":{\"n\":%lu,\"p50Us\":%lu,\"p99Us\":%lu,\"maxUs\":%lu},"
+      "\"webCache\":{\"hits\":%lu,\"misses\":%lu}}",
+      (unsigned long)g_metPeriodCount,
+      (unsigned long)metrics_periodPercentileUs(50),
+      (unsigned long)metrics_periodPercentileUs(99),
+      (unsigned long)g_metPeriodMaxUs,
+      (unsigned long)g_metCacheHits,
+      (unsigned long)g_metCacheMisses);
+  }
+  return pos;
+}
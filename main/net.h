@@ -1,82 +1,175 @@
 #pragma once
 #include <WiFi.h>
 
-static volatile bool wifiUp = false;
+// Non-blocking WiFi state machine.
+//
+//   CONNECTING --got IP--> CONNECTED --disconnect--> BACKOFF --timer--> CONNECTING
+//   CONNECTING --timeout/disconnect--> BACKOFF (delay doubles each attempt)
+//   after NET_MAX_ATTEMPTS failures BACKOFF becomes FAILED (slow retry)
+//
+// WiFi events only set flags; net_loop() advances the machine and delivers
+// NET_EVT_UP / NET_EVT_DOWN to the registered handler in the caller's task.
+
+enum NetState : uint8_t {
+  NET_IDLE       = 0,
+  NET_CONNECTING = 1,
+  NET_CONNECTED  = 2,
+  NET_BACKOFF    = 3,
+  NET_FAILED     = 4
+};
+
+enum NetEvent : uint8_t {
+  NET_EVT_UP   = 0,
+  NET_EVT_DOWN = 1
+};
+
+typedef void (*NetEventHandler)(NetEvent evt);
+
+static const uint32_t NET_CONNECT_TIMEOUT_MS = 15000;   // per attempt
+static const uint32_t NET_BACKOFF_MIN_MS     = 1000;
+static const uint32_t NET_BACKOFF_MAX_MS     = 60000;
+static const uint32_t NET_FAILED_RETRY_MS    = 300000;  // 5 min once FAILED
+static const uint8_t  NET_MAX_ATTEMPTS       = 8;
+
+// Wall-clock time for log records (storage.h); UTC, set once connected
+static const char* NET_NTP_SERVER1 = "pool.ntp.org";
+static const char* NET_NTP_SERVER2 = "time.google.com";
+
 static const char* g_ssid = nullptr;
 static const char* g_pass = nullptr;
-static unsigned long g_lastReconnectAttempt = 0;
-static const unsigned long RECONNECT_INTERVAL_MS = 30000;  // Retry every 30 seconds
 
-static bool net_begin(const char* ssid, const char* pass) {
-  g_ssid = ssid;
-  g_pass = pass;
+static volatile NetState g_netState = NET_IDLE;
+static volatile bool g_netEvtGotIp = false;
+static volatile bool g_netEvtLost = false;
 
-  WiFi.mode(WIFI_STA);
-  WiFi.setSleep(false);
-  WiFi.begin(ssid, pass);
-
-  Serial.print("[NET] connecting");
-  unsigned long t0 = millis();
+static NetEventHandler g_netHandler = nullptr;
+static uint32_t g_netStateMs = 0;     // when the current state was entered
+static uint32_t g_netBackoffMs = 0;   // wait before the next attempt
+static uint8_t  g_netAttempts = 0;    // consecutive failed attempts
 
-  while (WiFi.status() != WL_CONNECTED && millis() - t0 < 20000) {
-    Serial.print(".");
-    delay(250);
-    yield();
+static const char* net_stateName(NetState s) {
+  switch (s) {
+    case NET_IDLE:       return "idle";
+    case NET_CONNECTING: return "connecting";
+    case NET_CONNECTED:  return "connected";
+    case NET_BACKOFF:    return "backoff";
+    case NET_FAILED:     return "failed";
   }
-  Serial.println();
+  return "?";
+}
 
-  if (WiFi.status() == WL_CONNECTED) {
-    wifiUp = true;
-    Serial.print("[NET] IP: ");
-    Serial.println(WiFi.localIP());
-    return true;
+// Runs in the WiFi event task: record what happened, nothing else
+static void net_onWifiEvent(WiFiEvent_t event, WiFiEventInfo_t info) {
+  switch (event) {
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+      g_netEvtGotIp = true;
+      break;
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+      // Our own WiFi.disconnect() in net_startAttempt, delivered late
+      if (info.wifi_sta_disconnected.reason == WIFI_REASON_ASSOC_LEAVE) break;
+      g_netEvtLost = true;
+      break;
+    case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+      g_netEvtLost = true;
+      break;
+    default:
+      break;
   }
-  wifiUp = false;
-  g_lastReconnectAttempt = millis();
-  Serial.println("[NET] connection failed");
-  return false;
 }
 
-// Returns true if WiFi just reconnected (for triggering webui update check)
-static bool net_tryReconnect() {
-  if (wifiUp) return false;
-  if (g_ssid == nullptr) return false;
-
-  unsigned long now = millis();
-  if (now - g_lastReconnectAttempt < RECONNECT_INTERVAL_MS) return false;
-
-  g_lastReconnectAttempt = now;
-  Serial.print("[NET] reconnecting");
+static void net_setState(NetState s) {
+  g_netState = s;
+  g_netStateMs = millis();
+}
 
+static void net_startAttempt() {
   WiFi.disconnect();
+  // After the disconnect: events from it or from the attempt that timed out
+  // must not fail this one
+  g_netEvtGotIp = false;
+  g_netEvtLost = false;
   WiFi.begin(g_ssid, g_pass);
+  net_setState(NET_CONNECTING);
+  Serial.printf("[NET] connecting (attempt %u)\n", (unsigned)g_netAttempts + 1);
+}
 
-  unsigned long t0 = millis();
-  while (WiFi.status() != WL_CONNECTED && millis() - t0 < 10000) {
-    Serial.print(".");
-    delay(250);
-    yield();
+static void net_attemptFailed() {
+  g_netAttempts++;
+  if (g_netAttempts >= NET_MAX_ATTEMPTS) {
+    g_netBackoffMs = NET_FAILED_RETRY_MS;
+    net_setState(NET_FAILED);
+  } else {
+    g_netBackoffMs = min(NET_BACKOFF_MAX_MS, NET_BACKOFF_MIN_MS << (g_netAttempts - 1));
+    net_setState(NET_BACKOFF);
   }
-  Serial.println();
+  Serial.printf("[NET] %s, retry in %lu s\n", net_stateName(g_netState),
+                (unsigned long)(g_netBackoffMs / 1000));
+}
 
-  if (WiFi.status() == WL_CONNECTED) {
-    wifiUp = true;
-    Serial.print("[NET] IP: ");
-    Serial.println(WiFi.localIP());
-    return true;  // Signal that we just reconnected
+static void net_onEvent(NetEventHandler handler) {
+  g_netHandler = handler;
+}
+
+// Starts connecting and returns immediately; call net_loop() regularly
+static void net_begin(const char* ssid, const char* pass) {
+  g_ssid = ssid;
+  g_pass = pass;
+
+  WiFi.mode(WIFI_STA);
+  WiFi.setSleep(false);
+  WiFi.setAutoReconnect(false);  // retries are ours, with backoff
+  WiFi.onEvent(net_onWifiEvent);
+
+  g_netAttempts = 0;
+  net_startAttempt();
+}
+
+static void net_loop() {
+  uint32_t now = millis();
+
+  switch (g_netState) {
+    case NET_IDLE:
+      break;
+
+    case NET_CONNECTING:
+      if (g_netEvtGotIp) {
+        g_netEvtGotIp = false;
+        g_netEvtLost = false;
+        g_netAttempts = 0;
+        net_setState(NET_CONNECTED);
+        Serial.print("[NET] IP: ");
+        Serial.println(WiFi.localIP());
+        configTime(0, 0, NET_NTP_SERVER1, NET_NTP_SERVER2);
+        if (g_netHandler) g_netHandler(NET_EVT_UP);
+      } else if (g_netEvtLost || now - g_netStateMs >= NET_CONNECT_TIMEOUT_MS) {
+        net_attemptFailed();
+      }
+      break;
+
+    case NET_CONNECTED:
+      if (g_netEvtLost) {
+        g_netEvtLost = false;
+        Serial.println("[NET] connection lost");
+        g_netAttempts = 0;
+        g_netBackoffMs = NET_BACKOFF_MIN_MS;
+        net_setState(NET_BACKOFF);
+        if (g_netHandler) g_netHandler(NET_EVT_DOWN);
+      }
+      break;
+
+    case NET_BACKOFF:
+    case NET_FAILED:
+      if (now - g_netStateMs >= g_netBackoffMs) net_startAttempt();
+      break;
   }
+}
 
-  Serial.println("[NET] reconnect failed");
-  return false;
+static NetState net_state() {
+  return g_netState;
 }
 
 static bool net_isUp() {
-  // Also check actual WiFi status in case connection dropped
-  if (wifiUp && WiFi.status() != WL_CONNECTED) {
-    wifiUp = false;
-    Serial.println("[NET] connection lost");
-  }
-  return wifiUp;
+  return g_netState == NET_CONNECTED;
 }
 
 static IPAddress net_ip() {
@@ -3,7 +3,10 @@
 #include <HTTPClient.h>
 #include <WiFiClientSecure.h>
 #include <Update.h>
+#include <esp_ota_ops.h>
 #include <esp_task_wdt.h>
+#include <mbedtls/sha256.h>
+#include <rom/miniz.h>
 #include "credentials.h"
 
 // Current firmware version - update this when releasing new versions
@@ -12,17 +15,117 @@
 // Path to store running firmware version on SD
 static const char* OTA_VERSION_FILE = "/firmware.version";
 
-// firmware.json URL
-static const char* OTA_FIRMWARE_JSON_URL =
-  "https://raw.githubusercontent.com/HBBobo/Irrigation/main/firmware/firmware.json";
-
 // Check interval: 6 hours in milliseconds
 static const uint32_t OTA_CHECK_INTERVAL_MS = 6UL * 60UL * 60UL * 1000UL;
+// Sooner while a staged download is incomplete
+static const uint32_t OTA_RETRY_INTERVAL_MS = 10UL * 60UL * 1000UL;
 
 // Track last check time
 static uint32_t g_lastOtaCheckMs = 0;
 static bool g_otaCheckedOnBoot = false;
 
+// ---- Boot-health gate
+// A freshly flashed image boots in PENDING_VERIFY. It is confirmed only
+// after OTA_HEALTH_CYCLES control periods in a row, each on time and with
+// fresh soil readings (continuous ADC or the analogRead fallback), and after WiFi and the web server have come
+// up. If that does not happen within OTA_HEALTH_TIMEOUT_MS, or the image
+// resets before, the bootloader falls back to the previous slot. Each step
+// is recorded in OTA_HEALTH_FILE. Without rollback support in the
+// bootloader images never boot pending and the gate stays inert.
+#define OTA_HEALTH_CYCLES         3000       // 30 s of 10 ms periods
+#define OTA_HEALTH_MAX_PERIOD_US  20000      // a later period is not healthy
+#define OTA_HEALTH_TIMEOUT_MS     (5UL * 60UL * 1000UL)
+
+static const char* OTA_HEALTH_FILE = "/firmware.health";
+
+enum OtaHealthState : uint8_t {
+  OTA_HEALTH_NONE = 0,   // running a confirmed image
+  OTA_HEALTH_PENDING,
+  OTA_HEALTH_CONFIRMED,
+  OTA_HEALTH_FAILED      // gave up on it; rollback was not possible
+};
+
+static volatile uint8_t g_otaHealth = OTA_HEALTH_NONE;
+static volatile uint32_t g_otaHealthyCycles = 0;
+
+// The Arduino core would confirm every image at startup; we do it here
+extern "C" bool verifyRollbackLater() {
+  return true;
+}
+
+// One-line outcome record: "<state> <version> <detail>"
+static void ota_healthRecord(const char* state, const char* version, const char* detail) {
+  storage_lock();
+  FsFile f = sd.open(OTA_HEALTH_FILE, O_WRITE | O_CREAT | O_TRUNC);
+  if (f) {
+    f.printf("%s %s %s\n", state, version, detail);
+    f.close();
+  }
+  storage_unlock();
+  Serial.printf("[OTA] health: %s %s %s\n", state, version, detail);
+}
+
+// setup(), after the card is up
+static void ota_healthBegin() {
+  esp_ota_img_states_t st;
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  if (esp_ota_get_state_partition(running, &st) == ESP_OK && st == ESP_OTA_IMG_PENDING_VERIFY) {
+    g_otaHealth = OTA_HEALTH_PENDING;
+    ota_healthRecord("pending", FIRMWARE_VERSION, running->label);
+    return;
+  }
+
+  // An image that never got confirmed leaves "pending"/"failed" behind;
+  // seeing it from a confirmed image means the bootloader rolled back
+  char line[96] = "";
+  storage_lock();
+  FsFile f = sd.open(OTA_HEALTH_FILE, O_RDONLY);
+  if (f) {
+    f.read(line, sizeof(line) - 1);
+    f.close();
+  }
+  storage_unlock();
+
+  char state[16], version[16];
+  if (sscanf(line, "%15s %15s", state, version) == 2 &&
+      (!strcmp(state, "pending") || !strcmp(state, "failed"))) {
+    char detail[48];
+    snprintf(detail, sizeof(detail), "back on %s (%s)", FIRMWARE_VERSION, state);
+    ota_healthRecord("rolledback", version, detail);
+  }
+}
+
+// Control task, every period
+static void ota_healthTick(uint32_t periodUs, bool sensorsOk) {
+  if (g_otaHealth != OTA_HEALTH_PENDING) return;
+  if (periodUs <= OTA_HEALTH_MAX_PERIOD_US && sensorsOk) g_otaHealthyCycles++;
+  else g_otaHealthyCycles = 0;
+}
+
+// Net task, every pass: confirms the image or gives it up
+static void ota_healthCheck(bool servicesUp) {
+  if (g_otaHealth != OTA_HEALTH_PENDING) return;
+
+  uint32_t cycles = g_otaHealthyCycles;
+  char detail[64];
+  if (cycles >= OTA_HEALTH_CYCLES && servicesUp) {
+    esp_ota_mark_app_valid_cancel_rollback();
+    g_otaHealth = OTA_HEALTH_CONFIRMED;
+    snprintf(detail, sizeof(detail), "after %lu s", (unsigned long)(millis() / 1000));
+    ota_healthRecord("confirmed", FIRMWARE_VERSION, detail);
+  } else if (millis() > OTA_HEALTH_TIMEOUT_MS) {
+    // Terminal before the call: it only returns if there is no valid slot
+    // to go back to (first flash, factory image), and then this image
+    // keeps running rather than failing again on every pass
+    g_otaHealth = OTA_HEALTH_FAILED;
+    snprintf(detail, sizeof(detail), "cycles=%lu services=%d", (unsigned long)cycles, servicesUp ? 1 : 0);
+    ota_healthRecord("failed", FIRMWARE_VERSION, detail);
+    storage_closeLog();
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+    ota_healthRecord("norollback", FIRMWARE_VERSION, "no valid slot, kept running");
+  }
+}
+
 // Compare version strings (e.g., "1.0.1" vs "1.0.2")
 static int ota_compareVersions(const String& v1, const String& v2) {
   int major1 = 0, minor1 = 0, patch1 = 0;
@@ -37,186 +140,503 @@ static int ota_compareVersions(const String& v1, const String& v2) {
   return 0;
 }
 
-// Fetch firmware info from GitHub
-// Returns remote version string and populates url with download URL
-static String ota_getRemoteFirmwareInfo(String& url) {
-  WiFiClientSecure client;
-  client.setInsecure();  // Skip SSL verification
-  client.setTimeout(10);
+// Firmware entry of firmware.json, over the same keep-alive session as the
+// download that may follow. nullptr if it could not be read or has no
+// version. It stays valid while the OTA job owns the session.
+static const ManifestFirmware* ota_getRemoteFirmwareInfo() {
+  Serial.println("[OTA] Checking for firmware update...");
+  const Manifest* m = storage_fetchManifest();
+  return m ? &m->firmware : nullptr;
+}
 
-  HTTPClient http;
-  http.setTimeout(15000);
+// ---- Staged update
+// Phase 1 downloads the image to OTA_PENDING_BIN in the background, over
+// the shared keep-alive session, hashing it as it streams. An interrupted
+// transfer is kept and resumed with a Range request by the next check, so
+// flaky WiFi only costs the bytes that were lost. A "<file>.sha" marker
+// next to each staged file names the release it belongs to; a different
+// release starts that file over.
+// Phase 2 runs only with a complete image whose SHA-256 matches
+// firmware.json: it flashes from the card one sector at a time, hashing
+// again what it writes, and makes the new slot bootable (Update.end) only
+// if that matches too. Anything else aborts and the running firmware stays.
+#define OTA_BLOCK               4096                  // flash sector, one Update.write
+#define OTA_DOWNLOAD_TIMEOUT_MS (10UL * 60UL * 1000UL)
+
+static const char* OTA_DIR               = "/firmware";
+static const char* OTA_PENDING_BIN       = "/firmware/pending.bin";
+static const char* OTA_PENDING_DELTA     = "/firmware/pending.delta";
+static const char* OTA_PENDING_BIN_SHA   = "/firmware/pending.bin.sha";    // markers written by
+static const char* OTA_PENDING_DELTA_SHA = "/firmware/pending.delta.sha";  // ota_stageFile
+
+static uint8_t g_otaBlock[OTA_BLOCK];  // static: keeps it off the task stack
+
+static void ota_shaHex(const uint8_t* digest, char* hex) {
+  for (int i = 0; i < 32; i++) snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+}
 
-  Serial.print("[OTA] Checking for firmware update...");
+// Phase 1: true once `path` holds the file and matches its hash
+static bool ota_stageFile(const char* path, const char* url, size_t size, const char* sha256) {
+  char marker[40];
+  char staged[65] = "";
+  size_t have = 0;
+  snprintf(marker, sizeof(marker), "%s.sha", path);
 
-  if (!http.begin(client, OTA_FIRMWARE_JSON_URL)) {
-    Serial.println(" begin failed");
-    return "";
+  storage_lock();
+  if (!sd.exists(OTA_DIR)) sd.mkdir(OTA_DIR);
+  FsFile f = sd.open(marker, O_RDONLY);
+  if (f) {
+    f.read(staged, 64);
+    f.close();
   }
-
-  int code = http.GET();
-  if (code != 200) {
-    Serial.printf(" HTTP %d\n", code);
-    http.end();
-    return "";
+  if (strcmp(staged, sha256) != 0) {
+    // Partial download of another release (or none): start this file over.
+    // The other staged file keeps its own marker and its bytes.
+    sd.remove(path);
+    f = sd.open(marker, O_WRITE | O_CREAT | O_TRUNC);
+    if (f) {
+      f.print(sha256);
+      f.close();
+    }
+  }
+  f = sd.open(path, O_RDONLY);
+  if (f) {
+    have = f.size();
+    f.close();
+  }
+  if (size && have > size) {
+    // Longer than the file can be: a Range past the end would only get 416
+    sd.remove(path);
+    have = 0;
+  }
+  storage_unlock();
+
+  uint8_t digest[32];
+  bool ok;
+  if (size && have == size) {
+    Serial.printf("[OTA] %s already on card\n", path);
+    ok = storage_hashFile(path, digest);
+  } else {
+    Serial.printf("[OTA] Downloading firmware from: %s\n", url);
+    ok = storage_downloadToFile(url, path, OTA_DOWNLOAD_TIMEOUT_MS, digest, true);
+  }
+  if (!ok) {
+    Serial.println("[OTA] Download incomplete, will resume");
+    return false;
   }
 
-  String json = http.getString();
-  http.end();
-  Serial.println(" OK");
+  char hex[65];
+  ota_shaHex(digest, hex);
+  if (strcmp(hex, sha256) != 0) {
+    Serial.printf("[OTA] SHA-256 mismatch: got %.16s..., expected %.16s...\n", hex, sha256);
+    storage_lock();
+    sd.remove(path);  // corrupt: fetch it again next time
+    storage_unlock();
+    return false;
+  }
+  return true;
+}
 
-  // Parse "firmware" section
-  int fwIdx = json.indexOf("\"firmware\"");
-  if (fwIdx < 0) return "";
+// Called once the new slot holds the whole image and its hash checked out
+static bool ota_finishFlash(uint32_t t0, const char* from) {
+  if (!Update.end(true)) {
+    Serial.printf("[OTA] Update end failed: %s\n", Update.errorString());
+    return false;
+  }
 
-  // Find "version" within firmware section
-  int versionIdx = json.indexOf("\"version\"", fwIdx);
-  if (versionIdx < 0) return "";
+  storage_lock();
+  sd.remove(OTA_PENDING_BIN);
+  sd.remove(OTA_PENDING_DELTA);
+  sd.remove(OTA_PENDING_BIN_SHA);
+  sd.remove(OTA_PENDING_DELTA_SHA);
+  storage_unlock();
 
-  int quoteStart = json.indexOf("\"", versionIdx + 9);
-  if (quoteStart < 0) return "";
+  Serial.printf("[OTA] Flashed from %s and verified in %lu ms. Rebooting...\n", from, (unsigned long)(millis() - t0));
+  return true;
+}
 
-  int quoteEnd = json.indexOf("\"", quoteStart + 1);
-  if (quoteEnd < 0) return "";
+// Phase 2: flash OTA_PENDING_BIN, verifying it again on the way
+static bool ota_flashFromCard(const ManifestFirmware& info) {
+  storage_lock();
+  FsFile f = sd.open(OTA_PENDING_BIN, O_RDONLY);
+  size_t size = f ? f.size() : 0;
+  storage_unlock();
+  if (!f || size == 0) return false;
 
-  String version = json.substring(quoteStart + 1, quoteEnd);
+  if (!Update.begin(size)) {
+    Serial.printf("[OTA] Not enough space: %s\n", Update.errorString());
+    storage_lock();
+    f.close();
+    storage_unlock();
+    return false;
+  }
 
-  // Find "url" within firmware section
-  int urlIdx = json.indexOf("\"url\"", fwIdx);
-  if (urlIdx < 0) return version;
+  Serial.printf("[OTA] Flashing %u bytes from card...\n", (unsigned)size);
+  uint32_t t0 = millis();
 
-  int urlQuoteStart = json.indexOf("\"", urlIdx + 5);
-  if (urlQuoteStart < 0) return version;
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
 
-  int urlQuoteEnd = json.indexOf("\"", urlQuoteStart + 1);
-  if (urlQuoteEnd < 0) return version;
+  uint8_t* block = g_otaBlock;
+  size_t written = 0;
+  bool ok = true;
+  int lastPercent = -1;
+  while (ok && written < size) {
+    // Feed watchdog during long operation
+    esp_task_wdt_reset();
 
-  url = json.substring(urlQuoteStart + 1, urlQuoteEnd);
+    storage_lock();
+    int n = f.read(block, OTA_BLOCK);
+    storage_unlock();
+    if (n <= 0) {
+      ok = false;
+      break;
+    }
+    mbedtls_sha256_update(&sha, block, n);
 
-  return version;
-}
+    if (Update.write(block, n) != (size_t)n) {
+      Serial.printf("[OTA] Write error: %s\n", Update.errorString());
+      ok = false;
+      break;
+    }
+    written += n;
 
-// Download and flash firmware from URL
-static bool ota_performUpdate(const String& url) {
-  Serial.printf("[OTA] Downloading firmware from: %s\n", url.c_str());
+    // Progress indicator
+    int percent = (written * 100) / size;
+    if (percent / 10 != lastPercent / 10) {
+      Serial.printf("[OTA] Progress: %d%%\n", percent);
+      lastPercent = percent;
+    }
+  }
 
-  WiFiClientSecure client;
-  client.setInsecure();
-  client.setTimeout(30);
+  storage_lock();
+  f.close();
+  storage_unlock();
 
-  HTTPClient http;
-  http.setTimeout(60000);  // 60 second timeout for large file
+  uint8_t digest[32];
+  char hex[65];
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  ota_shaHex(digest, hex);
 
-  if (!http.begin(client, url)) {
-    Serial.println("[OTA] HTTP begin failed");
+  if (!ok || written != size || strcmp(hex, info.sha256) != 0) {
+    Serial.printf("[OTA] Flash aborted: %u/%u bytes, sha256 %.16s...\n", (unsigned)written, (unsigned)size, hex);
+    Update.abort();  // never marked bootable
     return false;
   }
 
-  int code = http.GET();
-  if (code != 200) {
-    Serial.printf("[OTA] HTTP error: %d\n", code);
-    http.end();
-    return false;
-  }
+  return ota_finishFlash(t0, "card");
+}
 
-  int contentLength = http.getSize();
-  if (contentLength <= 0) {
-    Serial.println("[OTA] Invalid content length");
-    http.end();
-    return false;
+// ---- Delta update
+// firmware.json may list, per earlier release, a zlib-compressed delta
+// made by firmware/mkdelta.py. When one matches the running version and
+// the running slot holds exactly the image it was made from, the delta is
+// staged instead of the full image and applied from the card: ops are
+// inflated one at a time, old bytes come from the running partition, and
+// the result goes to the spare slot a sector at a time, hashed like a full
+// image. RAM use is the inflate window plus three sectors, whatever the
+// image size. Anything wrong falls back to the full image.
+#define OTA_DELTA_MAGIC  0x31445249UL  // "IRD1"
+
+enum : uint8_t { OTA_DELTA_END = 0, OTA_DELTA_ADD = 1, OTA_DELTA_DIFF = 2 };
+
+#define OTA_DELTA_MAX_MISSES  3   // failed delta downloads before giving up on it
+
+static bool g_otaDeltaFailed = false;  // this boot: full images only
+static uint8_t g_otaDeltaMisses = 0;
+
+struct OtaDeltaIn {
+  tinfl_decompressor inf;
+  uint8_t dict[TINFL_LZ_DICT_SIZE];  // inflate window, read back as output
+  uint8_t in[OTA_BLOCK];
+  uint8_t old[OTA_BLOCK];
+  uint8_t out[OTA_BLOCK];
+  FsFile* f;
+  size_t inPos, inLen;
+  bool inEof;
+  size_t dictOfs;             // where inflate writes next
+  size_t availPos, availLen;  // inflated bytes not consumed yet
+  tinfl_status status;
+};
+
+// Next n bytes of the inflated delta
+static bool ota_deltaRead(OtaDeltaIn& d, uint8_t* dst, size_t n) {
+  while (n) {
+    if (d.availLen == 0) {
+      if (d.status == TINFL_STATUS_DONE) return false;  // ops past the end
+      if (d.inPos == d.inLen && !d.inEof) {
+        storage_lock();
+        int r = d.f->read(d.in, OTA_BLOCK);
+        storage_unlock();
+        if (r < 0) return false;
+        d.inPos = 0;
+        d.inLen = r;
+        d.inEof = r < OTA_BLOCK;
+      }
+      size_t inBytes = d.inLen - d.inPos;
+      size_t outBytes = TINFL_LZ_DICT_SIZE - d.dictOfs;
+      d.status = tinfl_decompress(&d.inf, d.in + d.inPos, &inBytes, d.dict, d.dict + d.dictOfs, &outBytes,
+                                  TINFL_FLAG_PARSE_ZLIB_HEADER | (d.inEof ? 0 : TINFL_FLAG_HAS_MORE_INPUT));
+      if (d.status < TINFL_STATUS_DONE) return false;  // corrupt or truncated
+      d.inPos += inBytes;
+      d.availPos = d.dictOfs;
+      d.availLen = outBytes;
+      d.dictOfs = (d.dictOfs + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+      continue;
+    }
+    size_t k = n < d.availLen ? n : d.availLen;
+    memcpy(dst, d.dict + d.availPos, k);
+    d.availPos += k;
+    d.availLen -= k;
+    dst += k;
+    n -= k;
   }
+  return true;
+}
 
-  Serial.printf("[OTA] Firmware size: %d bytes\n", contentLength);
+static bool ota_deltaU32(OtaDeltaIn& d, uint32_t& v) {
+  uint8_t b[4];
+  if (!ota_deltaRead(d, b, 4)) return false;
+  v = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+  return true;
+}
 
-  // Check if there's enough space
-  if (!Update.begin(contentLength)) {
-    Serial.printf("[OTA] Not enough space: %s\n", Update.errorString());
-    http.end();
-    return false;
+// True if the running slot starts with the image the delta was made from
+static bool ota_runningMatches(const ManifestDelta& delta) {
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  if (!running || delta.fromSize > running->size) return false;
+
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  bool ok = true;
+  for (size_t off = 0; ok && off < delta.fromSize; off += OTA_BLOCK) {
+    size_t n = delta.fromSize - off < OTA_BLOCK ? delta.fromSize - off : OTA_BLOCK;
+    ok = esp_partition_read(running, off, g_otaBlock, n) == ESP_OK;
+    mbedtls_sha256_update(&sha, g_otaBlock, n);
   }
+  uint8_t digest[32];
+  char hex[65];
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  ota_shaHex(digest, hex);
+  return ok && strcmp(hex, delta.fromSha256) == 0;
+}
 
-  Serial.println("[OTA] Flashing firmware...");
+// Phase 2 from a delta: patch the running image into the spare slot
+static bool ota_flashDelta(const ManifestFirmware& info, const ManifestDelta& delta) {
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  OtaDeltaIn* d = (OtaDeltaIn*)malloc(sizeof(OtaDeltaIn));
+  if (!d) {
+    Serial.printf("[OTA] No memory for delta (%u bytes)\n", (unsigned)sizeof(OtaDeltaIn));
+    return false;
+  }
+  memset(d, 0, sizeof(*d));
+  tinfl_init(&d->inf);
+  d->status = TINFL_STATUS_NEEDS_MORE_INPUT;
+
+  storage_lock();
+  FsFile f = sd.open(OTA_PENDING_DELTA, O_RDONLY);
+  storage_unlock();
+  d->f = &f;
+
+  uint32_t magic = 0, oldSize = 0, newSize = 0;
+  bool ok = f && ota_deltaU32(*d, magic) && ota_deltaU32(*d, oldSize) && ota_deltaU32(*d, newSize) &&
+            magic == OTA_DELTA_MAGIC && oldSize == delta.fromSize && newSize > 0 &&
+            (!info.size || newSize == info.size);
+  if (!ok) {
+    Serial.println("[OTA] Delta header does not match firmware.json");
+  } else if (!Update.begin(newSize)) {
+    Serial.printf("[OTA] Not enough space: %s\n", Update.errorString());
+    ok = false;
+  }
 
-  WiFiClient* stream = http.getStreamPtr();
-  uint8_t buf[1024];
-  size_t written = 0;
-  int lastPercent = -1;
+  uint32_t t0 = millis();
+  if (ok) Serial.printf("[OTA] Patching %s into %u bytes...\n", FIRMWARE_VERSION, (unsigned)newSize);
 
-  while (http.connected() && written < (size_t)contentLength) {
-    // Feed watchdog during long operation
-    esp_task_wdt_reset();
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
 
-    size_t available = stream->available();
-    if (available) {
-      size_t toRead = min(available, sizeof(buf));
-      size_t bytesRead = stream->readBytes(buf, toRead);
+  size_t fill = 0, written = 0;
+  int lastPercent = -1;
+  bool done = false;
+  while (ok && !done) {
+    uint8_t op;
+    uint32_t off = 0, len = 0;
+    if (!ota_deltaRead(*d, &op, 1)) {
+      ok = false;
+      break;
+    }
+    if (op == OTA_DELTA_END) {
+      done = true;
+    } else if (op == OTA_DELTA_ADD) {
+      ok = ota_deltaU32(*d, len);
+    } else if (op == OTA_DELTA_DIFF) {
+      ok = ota_deltaU32(*d, off) && ota_deltaU32(*d, len) && off <= oldSize && len <= oldSize - off;
+    } else {
+      ok = false;
+    }
+    if (ok && len > newSize - (written + fill)) ok = false;  // would overrun the image
+
+    while (ok && len) {
+      size_t n = OTA_BLOCK - fill < len ? OTA_BLOCK - fill : len;
+      uint8_t* out = d->out + fill;
+      ok = ota_deltaRead(*d, out, n);
+      if (ok && op == OTA_DELTA_DIFF) {
+        ok = esp_partition_read(running, off, d->old, n) == ESP_OK;
+        for (size_t i = 0; i < n; i++) out[i] += d->old[i];
+        off += n;
+      }
+      fill += n;
+      len -= n;
 
-      if (bytesRead > 0) {
-        size_t bytesWritten = Update.write(buf, bytesRead);
-        if (bytesWritten != bytesRead) {
+      if (ok && (fill == OTA_BLOCK || written + fill == newSize)) {
+        esp_task_wdt_reset();
+        mbedtls_sha256_update(&sha, d->out, fill);
+        if (Update.write(d->out, fill) != fill) {
           Serial.printf("[OTA] Write error: %s\n", Update.errorString());
-          Update.abort();
-          http.end();
-          return false;
+          ok = false;
         }
-        written += bytesWritten;
+        written += fill;
+        fill = 0;
 
-        // Progress indicator
-        int percent = (written * 100) / contentLength;
-        if (percent != lastPercent && percent % 10 == 0) {
+        int percent = (written * 100) / newSize;
+        if (percent / 10 != lastPercent / 10) {
           Serial.printf("[OTA] Progress: %d%%\n", percent);
           lastPercent = percent;
         }
       }
     }
-    delay(1);  // Yield
   }
 
-  http.end();
+  storage_lock();
+  if (f) f.close();
+  storage_unlock();
+  free(d);
+
+  uint8_t digest[32];
+  char hex[65];
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  ota_shaHex(digest, hex);
 
-  if (written != (size_t)contentLength) {
-    Serial.printf("[OTA] Size mismatch: got %u, expected %d\n", (unsigned)written, contentLength);
-    Update.abort();
+  if (!ok || written != newSize || strcmp(hex, info.sha256) != 0) {
+    Serial.printf("[OTA] Delta aborted: %u/%u bytes, sha256 %.16s...\n", (unsigned)written, (unsigned)newSize, hex);
+    if (Update.isRunning()) Update.abort();
     return false;
   }
+  return ota_finishFlash(t0, "delta");
+}
 
-  if (!Update.end(true)) {
-    Serial.printf("[OTA] Update end failed: %s\n", Update.errorString());
+// Stages and applies the delta; false means use the full image
+static bool ota_tryDelta(const ManifestFirmware& info, bool& retryLater) {
+  retryLater = false;
+  const ManifestDelta* delta = manifest_delta(info, FIRMWARE_VERSION);
+  if (!delta || g_otaDeltaFailed) return false;
+  if (!ota_runningMatches(*delta)) {
+    Serial.println("[OTA] Running image is not the delta base, using the full image");
     return false;
   }
 
-  Serial.println("[OTA] Update successful! Rebooting...");
-  return true;
-}
+  Serial.printf("[OTA] Delta from %s: %u bytes\n", FIRMWARE_VERSION, (unsigned)delta->size);
+  if (!ota_stageFile(OTA_PENDING_DELTA, delta->url, delta->size, delta->sha256)) {
+    // Resume it next time; a delta that keeps failing is given up on
+    if (++g_otaDeltaMisses >= OTA_DELTA_MAX_MISSES) g_otaDeltaFailed = true;
+    retryLater = true;
+    return false;
+  }
 
-// Check for and apply firmware update
-static void ota_checkForUpdate() {
-  String url;
-  String remoteVersion = ota_getRemoteFirmwareInfo(url);
+  // Nothing buffered may be lost if the update reboots us; the TLS
+  // session's buffers go back to the heap for the inflater
+  storage_closeLog();
+  storage_dlEnd();
+  if (ota_flashDelta(info, *delta)) return true;
+
+  Serial.println("[OTA] Delta failed, falling back to the full image");
+  g_otaDeltaFailed = true;
+  storage_lock();
+  sd.remove(OTA_PENDING_DELTA);
+  sd.remove(OTA_PENDING_DELTA_SHA);
+  storage_unlock();
+  return false;
+}
 
-  if (remoteVersion.length() == 0) {
+// Check for and apply firmware update (runs in the OTA job task).
+// Returns false if an update is pending but could not be completed.
+static bool ota_checkForUpdate() {
+  const ManifestFirmware* fw = ota_getRemoteFirmwareInfo();
+  if (!fw || !fw->version[0]) {
     Serial.println("[OTA] Could not get remote version");
-    return;
+    return false;
   }
+  const ManifestFirmware& info = *fw;
 
-  Serial.printf("[OTA] Current: %s, Remote: %s\n", FIRMWARE_VERSION, remoteVersion.c_str());
+  Serial.printf("[OTA] Current: %s, Remote: %s\n", FIRMWARE_VERSION, info.version);
 
-  if (ota_compareVersions(FIRMWARE_VERSION, remoteVersion) >= 0) {
+  if (ota_compareVersions(FIRMWARE_VERSION, info.version) >= 0) {
     Serial.println("[OTA] Firmware is up to date");
-    return;
+    return true;
   }
 
   Serial.println("[OTA] New firmware available!");
 
-  if (url.length() == 0) {
+  if (!info.url[0]) {
     Serial.println("[OTA] No download URL found");
-    return;
+    return true;
+  }
+  if (!info.sha256[0]) {
+    Serial.println("[OTA] No sha256 in firmware.json, refusing to flash");
+    return true;
   }
 
-  if (ota_performUpdate(url)) {
+  bool retryLater;
+  if (ota_tryDelta(info, retryLater)) {
     delay(1000);
     ESP.restart();
+    return true;
+  }
+  if (retryLater) return false;  // resume the delta rather than fetch it all
+
+  if (!ota_stageFile(OTA_PENDING_BIN, info.url, info.size, info.sha256)) return false;
+
+  // Nothing buffered may be lost if the update reboots us
+  storage_closeLog();
+
+  if (!ota_flashFromCard(info)) return false;
+  delay(1000);
+  ESP.restart();
+  return true;
+}
+
+// ---- Background job: check, stage and flash without holding up the net
+// task. Shares the download session with the web UI sync, one at a time.
+#define OTA_JOB_STACK  12288  // TLS handshake, like the net task
+
+static volatile bool g_otaJobRunning = false;
+static volatile bool g_otaRetrySoon = false;
+
+static void ota_jobTask(void*) {
+  esp_task_wdt_add(NULL);
+  g_otaRetrySoon = !ota_checkForUpdate();
+  storage_dlRelease();
+  esp_task_wdt_delete(NULL);
+  g_otaJobRunning = false;
+  vTaskDelete(NULL);
+}
+
+// Starts a check; false if one is running or the session is busy
+static bool ota_startCheck() {
+  if (g_otaJobRunning || !storage_dlAcquire()) return false;
+  g_otaJobRunning = true;
+  if (xTaskCreatePinnedToCore(ota_jobTask, "ota", OTA_JOB_STACK, nullptr, 1, nullptr, 0) != pdPASS) {
+    storage_dlRelease();
+    g_otaJobRunning = false;
+    return false;
   }
+  return true;
 }
 
 // Save current firmware version to SD card
@@ -238,6 +658,7 @@ static void ota_begin() {
 
   ArduinoOTA.onStart([]() {
     Serial.println("[OTA] Local update starting...");
+    storage_closeLog();
   });
 
   ArduinoOTA.onEnd([]() {
@@ -265,19 +686,24 @@ static void ota_loop() {
   // Handle local network OTA
   ArduinoOTA.handle();
 
+  // No updates on top of an image that is not confirmed yet
+  if (g_otaHealth == OTA_HEALTH_PENDING) return;
+
   uint32_t now = millis();
 
-  // Check on boot (after a short delay to let things stabilize)
+  // Check on boot (after a short delay to let things stabilize); a busy
+  // session (web UI sync) just defers it to a later pass
   if (!g_otaCheckedOnBoot && now > 10000) {
-    g_otaCheckedOnBoot = true;
-    g_lastOtaCheckMs = now;
-    ota_checkForUpdate();
+    if (ota_startCheck()) {
+      g_otaCheckedOnBoot = true;
+      g_lastOtaCheckMs = now;
+    }
     return;
   }
 
-  // Check every 6 hours
-  if (now - g_lastOtaCheckMs >= OTA_CHECK_INTERVAL_MS) {
+  // Check every 6 hours, or sooner to finish a staged download
+  uint32_t interval = g_otaRetrySoon ? OTA_RETRY_INTERVAL_MS : OTA_CHECK_INTERVAL_MS;
+  if (now - g_lastOtaCheckMs >= interval && ota_startCheck()) {
     g_lastOtaCheckMs = now;
-    ota_checkForUpdate();
   }
 }
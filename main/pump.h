@@ -0,0 +1,96 @@
+#pragma once
+#include <Arduino.h>
+
+// Pump motor driver: direction on IN1/IN2, speed as LEDC PWM on EN1.
+// The soft ramp is stepped by pump_tick() from the control loop rather than
+// a hardware LEDC fade: ledcWrite waits for a running fade to finish, so a
+// stop during a hardware ramp would stall the control task for up to rampMs.
+
+#define EN1_PIN      13   // Motor driver enable (LEDC PWM)
+#define IN1_PIN      14   // Motor driver input 1
+#define IN2_PIN      27   // Motor driver input 2
+
+#define PUMP_PWM_FREQ_HZ  20000   // above audible range
+#define PUMP_PWM_BITS     8       // duty 0..255, same scale as Config::pumpPwm
+
+static bool     g_pumpRunning = false;
+static uint8_t  g_pumpTarget = 0;    // duty we are running at / ramping to
+static uint8_t  g_pumpDuty = 0;      // duty last written to EN1
+static uint32_t g_pumpRampStartMs = 0;
+static uint32_t g_pumpRampMs = 0;    // 0 = no ramp in progress
+
+static void pump_write(uint8_t duty) {
+  if (duty == g_pumpDuty) return;
+  ledcWrite(EN1_PIN, duty);
+  g_pumpDuty = duty;
+}
+
+static void pump_begin() {
+  pinMode(IN1_PIN, OUTPUT);
+  pinMode(IN2_PIN, OUTPUT);
+  digitalWrite(IN1_PIN, LOW);
+  digitalWrite(IN2_PIN, LOW);
+
+  ledcAttach(EN1_PIN, PUMP_PWM_FREQ_HZ, PUMP_PWM_BITS);
+  ledcWrite(EN1_PIN, 0);
+  g_pumpDuty = 0;
+}
+
+// Start in the forward direction, ramping 0 -> duty over rampMs (0 = instant)
+static void pump_start(uint8_t duty, uint32_t rampMs) {
+  digitalWrite(IN1_PIN, LOW);
+  digitalWrite(IN2_PIN, HIGH);
+
+  g_pumpRunning = true;
+  g_pumpTarget = duty;
+  if (rampMs > 0 && duty > 0) {
+    g_pumpRampStartMs = millis();
+    g_pumpRampMs = rampMs;
+    pump_write(0);
+  } else {
+    g_pumpRampMs = 0;
+    pump_write(duty);
+  }
+}
+
+static void pump_stop() {
+  pump_write(0);
+  digitalWrite(IN1_PIN, LOW);
+  digitalWrite(IN2_PIN, LOW);
+  g_pumpRunning = false;
+  g_pumpTarget = 0;
+  g_pumpRampMs = 0;
+}
+
+// Advances the soft ramp; call every control cycle
+static void pump_tick() {
+  if (g_pumpRampMs == 0) return;
+  uint32_t elapsed = millis() - g_pumpRampStartMs;
+  if (elapsed >= g_pumpRampMs) {
+    g_pumpRampMs = 0;
+    pump_write(g_pumpTarget);
+    return;
+  }
+  pump_write((uint8_t)((uint64_t)g_pumpTarget * elapsed / g_pumpRampMs));
+}
+
+// Ramp progress 0..100; 100 once the ramp has finished (or with no ramp)
+static uint8_t pump_rampPct() {
+  if (g_pumpRampMs == 0) return g_pumpRunning ? 100 : 0;
+  uint32_t elapsed = millis() - g_pumpRampStartMs;
+  if (elapsed >= g_pumpRampMs) return 100;
+  return (uint8_t)((uint64_t)elapsed * 100 / g_pumpRampMs);
+}
+
+// Current duty on EN1
+static uint8_t pump_duty() {
+  return g_pumpDuty;
+}
+
+// Follow pumpPwm changes while running; a ramp in progress finishes first
+static void pump_setDuty(uint8_t duty) {
+  if (!g_pumpRunning || duty == g_pumpTarget) return;
+  if (g_pumpRampMs != 0) return;
+  pump_write(duty);
+  g_pumpTarget = duty;
+}
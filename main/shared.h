@@ -0,0 +1,65 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+
+// State shared between the control task and the service tasks (web, OTA,
+// storage). The control task never blocks on any of these.
+
+// ---- Runtime snapshot (seqlock)
+// Written only by the control task; readers retry if they raced a write.
+static volatile uint32_t g_rtSeq = 0;
+static Runtime g_rtShared;
+
+static void shared_publishRuntime(const Runtime& r) {
+  uint32_t seq = g_rtSeq;
+  g_rtSeq = seq + 1;  // odd: write in progress
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  memcpy((void*)&g_rtShared, &r, sizeof(Runtime));
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  g_rtSeq = seq + 2;
+}
+
+static void shared_getRuntime(Runtime& out) {
+  for (;;) {
+    uint32_t seq = g_rtSeq;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (seq & 1) continue;
+    memcpy(&out, (const void*)&g_rtShared, sizeof(Runtime));
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (g_rtSeq == seq) return;
+  }
+}
+
+// ---- Config hand-over (web -> control)
+// g_cfgShared is the web side's config: every edit starts from it and is
+// stored back before it is queued, so edits made faster than the control
+// task picks them up all land. The control task keeps its own copy and
+// only receives whole configs through the single-slot queue (a newer one
+// overwrites one not yet picked up).
+static QueueHandle_t g_cfgQueue = nullptr;
+static Config g_cfgShared;
+static portMUX_TYPE g_cfgMux = portMUX_INITIALIZER_UNLOCKED;
+
+// setup(), with the config loaded and before the tasks start
+static void shared_begin(const Config& c) {
+  if (!g_cfgQueue) g_cfgQueue = xQueueCreate(1, sizeof(Config));
+  g_cfgShared = c;
+}
+
+static void shared_getConfig(Config& c) {
+  portENTER_CRITICAL(&g_cfgMux);
+  c = g_cfgShared;
+  portEXIT_CRITICAL(&g_cfgMux);
+}
+
+static void shared_postConfig(const Config& c) {
+  portENTER_CRITICAL(&g_cfgMux);
+  g_cfgShared = c;
+  portEXIT_CRITICAL(&g_cfgMux);
+  if (g_cfgQueue) xQueueOverwrite(g_cfgQueue, &c);
+}
+
+// Called by the control task at the start of each cycle
+static bool shared_takeConfig(Config& c) {
+  return g_cfgQueue && xQueueReceive(g_cfgQueue, &c, 0) == pdTRUE;
+}
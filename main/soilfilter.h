@@ -0,0 +1,78 @@
+#pragma once
+#include <Arduino.h>
+
+// Soil ADC filter: median over the last N frames (kills single-frame spikes)
+// followed by a first-order IIR. Plain C++ so the host simulator shares it.
+
+#define SOILFILTER_MAX_N 15
+
+struct SoilFilter {
+  int16_t ring[SOILFILTER_MAX_N];
+  uint8_t head = 0;
+  uint8_t count = 0;
+
+  uint8_t medianN = 7;   // odd, 1..SOILFILTER_MAX_N
+  uint8_t iirPct = 25;   // weight of a new median, % (100 = no smoothing)
+
+  int32_t iirQ8 = 0;     // filtered value * 256
+  bool primed = false;
+
+  // Running statistics of the raw frames (EWMA, ~64 frames)
+  float mean = 0;
+  float var = 0;
+};
+
+static void soilfilter_configure(SoilFilter& f, int medianN, int iirPct) {
+  medianN = constrain(medianN, 1, SOILFILTER_MAX_N);
+  if ((medianN & 1) == 0) medianN--;
+  f.medianN = (uint8_t)medianN;
+  f.iirPct = (uint8_t)constrain(iirPct, 1, 100);
+}
+
+// Called for every raw frame
+static void soilfilter_push(SoilFilter& f, int raw) {
+  f.ring[f.head] = (int16_t)raw;
+  f.head = (f.head + 1) % SOILFILTER_MAX_N;
+  if (f.count < SOILFILTER_MAX_N) f.count++;
+
+  if (f.count == 1) {
+    f.mean = raw;
+    f.var = 0;
+  } else {
+    float d = raw - f.mean;
+    f.mean += d / 64.0f;
+    f.var += (d * d - f.var) / 64.0f;
+  }
+}
+
+// Called at the output rate: median of the newest frames, then IIR
+static int soilfilter_output(SoilFilter& f) {
+  if (f.count == 0) return f.iirQ8 >> 8;
+
+  uint8_t n = min(f.medianN, f.count);
+  int16_t w[SOILFILTER_MAX_N];
+  int idx = f.head;
+  for (uint8_t i = 0; i < n; i++) {
+    idx = idx ? idx - 1 : SOILFILTER_MAX_N - 1;  // newest first
+    w[i] = f.ring[idx];
+  }
+
+  // Odd-even transposition sort: a fixed pattern of compare-exchanges that
+  // compile to min/max, so noisy input costs no mispredicted branches
+  for (uint8_t pass = 0; pass < n; pass++) {
+    for (uint8_t i = pass & 1; i + 1 < n; i += 2) {
+      int16_t a = w[i], b = w[i + 1];
+      w[i] = a < b ? a : b;
+      w[i + 1] = a < b ? b : a;
+    }
+  }
+  int32_t med = (int32_t)w[n / 2] << 8;
+
+  if (!f.primed) {
+    f.iirQ8 = med;
+    f.primed = true;
+  } else {
+    f.iirQ8 += (med - f.iirQ8) * f.iirPct / 100;
+  }
+  return (f.iirQ8 + 128) >> 8;
+}
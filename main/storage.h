@@ -4,30 +4,48 @@
 #include <HTTPClient.h>
 #include <WiFiClientSecure.h>
 #include <esp_task_wdt.h>
+#include <freertos/event_groups.h>
+#include <mbedtls/sha256.h>
 
 #include "config.h"
+#include "logbuf.h"
+#include "logfmt.h"
+#include "history.h"
+#include "manifest.h"
 
 extern const char* FW_VERSION;
 
 static SdFat sd;
 static bool g_sdReady = false;
 
+// SdFat is not thread-safe: every task touching the card takes this first
+static SemaphoreHandle_t g_sdMutex = nullptr;
+
 // ---- paths
 static const char* PATH_CFG  = "/cfg.txt";
 static const char* PATH_HIST = "/hist.bin";
-static const char* PATH_LOG  = "/log.csv";
+static const char* PATH_HIST_MIN  = "/hist_min.bin";
+static const char* PATH_HIST_HOUR = "/hist_hour.bin";
+
+// Binary segment log (logfmt.h)
+static const char* LOG_DIR        = "/log";
+static const char* PATH_LOG_INDEX = "/log/index.bin";
+static const char* PATH_BOOT_ID   = "/log/boot.id";
 
 // Web UI on SD
 static const char* WEB_DIR = "/web";
-static const char* WEB_INDEX = "/web/index.html";
+static const char* WEB_INDEX = "/web/index.html.gz";
 
 // GitHub raw base (UI files)
 static const char* GH_WEB_BASE =
   "https://raw.githubusercontent.com/HBBobo/Irrigation/main/webui";
 
-// GitHub/DigiCert Root CA certificate for secure downloads
-// This is DigiCert Global Root CA - valid for raw.githubusercontent.com
+// Roots that GitHub's download hosts chain to. raw.githubusercontent.com
+// has moved between DigiCert roots, and github.com uses Sectigo/USERTrust,
+// so trusting this set rather than one certificate survives a reissue
+// without letting an unauthenticated server feed us firmware.json.
 static const char* GITHUB_ROOT_CA = R"EOF(
+# DigiCert Global Root CA
 -----BEGIN CERTIFICATE-----
 MIIDrzCCApegAwIBAgIQCDvgVpBCRrGhdWrJWZHHSjANBgkqhkiG9w0BAQUFADBh
 MQswCQYDVQQGEwJVUzEVMBMGA1UEChMMRGlnaUNlcnQgSW5jMRkwFwYDVQQLExB3
@@ -50,6 +68,81 @@ PnlUkiaY4IBIqDfv8NZ5YBberOgOzW6sRBc4L0na4UU+Krk2U886UAb3LujEV0ls
 YSEY1QSteDwsOoBrp+uvFRTp2InBuThs4pFsiv9kuXclVzDAGySj4dzp30d8tbQk
 CAUw7C29C79Fv1C5qfPrmAESrciIxpg0X40KPMbp1ZWVbd4=
 -----END CERTIFICATE-----
+# DigiCert Global Root G2
+-----BEGIN CERTIFICATE-----
+MIIDjjCCAnagAwIBAgIQAzrx5qcRqaC7KGSxHQn65TANBgkqhkiG9w0BAQsFADBh
+MQswCQYDVQQGEwJVUzEVMBMGA1UEChMMRGlnaUNlcnQgSW5jMRkwFwYDVQQLExB3
+d3cuZGlnaWNlcnQuY29tMSAwHgYDVQQDExdEaWdpQ2VydCBHbG9iYWwgUm9vdCBH
+MjAeFw0xMzA4MDExMjAwMDBaFw0zODAxMTUxMjAwMDBaMGExCzAJBgNVBAYTAlVT
+MRUwEwYDVQQKEwxEaWdpQ2VydCBJbmMxGTAXBgNVBAsTEHd3dy5kaWdpY2VydC5j
+b20xIDAeBgNVBAMTF0RpZ2lDZXJ0IEdsb2JhbCBSb290IEcyMIIBIjANBgkqhkiG
+9w0BAQEFAAOCAQ8AMIIBCgKCAQEAuzfNNNx7a8myaJCtSnX/RrohCgiN9RlUyfuI
+2/Ou8jqJkTx65qsGGmvPrC3oXgkkRLpimn7Wo6h+4FR1IAWsULecYxpsMNzaHxmx
+1x7e/dfgy5SDN67sH0NO3Xss0r0upS/kqbitOtSZpLYl6ZtrAGCSYP9PIUkY92eQ
+q2EGnI/yuum06ZIya7XzV+hdG82MHauVBJVJ8zUtluNJbd134/tJS7SsVQepj5Wz
+tCO7TG1F8PapspUwtP1MVYwnSlcUfIKdzXOS0xZKBgyMUNGPHgm+F6HmIcr9g+UQ
+vIOlCsRnKPZzFBQ9RnbDhxSJITRNrw9FDKZJobq7nMWxM4MphQIDAQABo0IwQDAP
+BgNVHRMBAf8EBTADAQH/MA4GA1UdDwEB/wQEAwIBhjAdBgNVHQ4EFgQUTiJUIBiV
+5uNu5g/6+rkS7QYXjzkwDQYJKoZIhvcNAQELBQADggEBAGBnKJRvDkhj6zHd6mcY
+1Yl9PMWLSn/pvtsrF9+wX3N3KjITOYFnQoQj8kVnNeyIv/iPsGEMNKSuIEyExtv4
+NeF22d+mQrvHRAiGfzZ0JFrabA0UWTW98kndth/Jsw1HKj2ZL7tcu7XUIOGZX1NG
+Fdtom/DzMNU+MeKNhJ7jitralj41E6Vf8PlwUHBHQRFXGU7Aj64GxJUTFy8bJZ91
+8rGOmaFvE7FBcf6IKshPECBV1/MUReXgRPTqh5Uykw7+U0b6LJ3/iyK5S9kJRaTe
+pLiaWN0bfVKfjllDiIGknibVb63dDcY3fe0Dkhvld1927jyNxF1WW6LZZm6zNTfl
+MrY=
+-----END CERTIFICATE-----
+# USERTrust RSA Certification Authority
+-----BEGIN CERTIFICATE-----
+MIIF3jCCA8agAwIBAgIQAf1tMPyjylGoG7xkDjUDLTANBgkqhkiG9w0BAQwFADCB
+iDELMAkGA1UEBhMCVVMxEzARBgNVBAgTCk5ldyBKZXJzZXkxFDASBgNVBAcTC0pl
+cnNleSBDaXR5MR4wHAYDVQQKExVUaGUgVVNFUlRSVVNUIE5ldHdvcmsxLjAsBgNV
+BAMTJVVTRVJUcnVzdCBSU0EgQ2VydGlmaWNhdGlvbiBBdXRob3JpdHkwHhcNMTAw
+MjAxMDAwMDAwWhcNMzgwMTE4MjM1OTU5WjCBiDELMAkGA1UEBhMCVVMxEzARBgNV
+BAgTCk5ldyBKZXJzZXkxFDASBgNVBAcTC0plcnNleSBDaXR5MR4wHAYDVQQKExVU
+aGUgVVNFUlRSVVNUIE5ldHdvcmsxLjAsBgNVBAMTJVVTRVJUcnVzdCBSU0EgQ2Vy
+dGlmaWNhdGlvbiBBdXRob3JpdHkwggIiMA0GCSqGSIb3DQEBAQUAA4ICDwAwggIK
+AoICAQCAEmUXNg7D2wiz0KxXDXbtzSfTTK1Qg2HiqiBNCS1kCdzOiZ/MPans9s/B
+3PHTsdZ7NygRK0faOca8Ohm0X6a9fZ2jY0K2dvKpOyuR+OJv0OwWIJAJPuLodMkY
+tJHUYmTbf6MG8YgYapAiPLz+E/CHFHv25B+O1ORRxhFnRghRy4YUVD+8M/5+bJz/
+Fp0YvVGONaanZshyZ9shZrHUm3gDwFA66Mzw3LyeTP6vBZY1H1dat//O+T23LLb2
+VN3I5xI6Ta5MirdcmrS3ID3KfyI0rn47aGYBROcBTkZTmzNg95S+UzeQc0PzMsNT
+79uq/nROacdrjGCT3sTHDN/hMq7MkztReJVni+49Vv4M0GkPGw/zJSZrM233bkf6
+c0Plfg6lZrEpfDKEY1WJxA3Bk1QwGROs0303p+tdOmw1XNtB1xLaqUkL39iAigmT
+Yo61Zs8liM2EuLE/pDkP2QKe6xJMlXzzawWpXhaDzLhn4ugTncxbgtNMs+1b/97l
+c6wjOy0AvzVVdAlJ2ElYGn+SNuZRkg7zJn0cTRe8yexDJtC/QV9AqURE9JnnV4ee
+UB9XVKg+/XRjL7FQZQnmWEIuQxpMtPAlR1n6BB6T1CZGSlCBst6+eLf8ZxXhyVeE
+Hg9j1uliutZfVS7qXMYoCAQlObgOK6nyTJccBz8NUvXt7y+CDwIDAQABo0IwQDAd
+BgNVHQ4EFgQUU3m/WqorSs9UgOHYm8Cd8rIDZsswDgYDVR0PAQH/BAQDAgEGMA8G
+A1UdEwEB/wQFMAMBAf8wDQYJKoZIhvcNAQEMBQADggIBAFzUfA3P9wF9QZllDHPF
+Up/L+M+ZBn8b2kMVn54CVVeWFPFSPCeHlCjtHzoBN6J2/FNQwISbxmtOuowhT6KO
+VWKR82kV2LyI48SqC/3vqOlLVSoGIG1VeCkZ7l8wXEskEVX/JJpuXior7gtNn3/3
+ATiUFJVDBwn7YKnuHKsSjKCaXqeYalltiz8I+8jRRa8YFWSQEg9zKC7F4iRO/Fjs
+8PRF/iKz6y+O0tlFYQXBl2+odnKPi4w2r78NBc5xjeambx9spnFixdjQg3IM8WcR
+iQycE0xyNN+81XHfqnHd4blsjDwSXWXavVcStkNr/+XeTWYRUc+ZruwXtuhxkYze
+Sf7dNXGiFSeUHM9h4ya7b6NnJSFd5t0dCy5oGzuCr+yDZ4XUmFF0sbmZgIn/f3gZ
+XHlKYC6SQK5MNyosycdiyA5d9zZbyuAlJQG03RoHnHcAP9Dc1ew91Pq7P8yF1m9/
+qS3fuQL39ZeatTXaw2ewh0qpKJ4jjv9cJ2vhsE/zB+4ALtRZh8tSQZXq9EfX7mRB
+VXyNWQKV3WKdwrnuWih0hKWbt5DHDAff9Yk2dDLWKMGwsAvgnEzDHNb842m1R0aB
+L6KCq9NjRHDEjf8tM7qtj3u1cIiuPhnPQCjY/MiQu12ZIvVS5ljFH4gxQ+6IHdfG
+jjxDah2nGN59PRbxYvnKkKj9
+-----END CERTIFICATE-----
+# USERTrust ECC Certification Authority
+-----BEGIN CERTIFICATE-----
+MIICjzCCAhWgAwIBAgIQXIuZxVqUxdJxVt7NiYDMJjAKBggqhkjOPQQDAzCBiDEL
+MAkGA1UEBhMCVVMxEzARBgNVBAgTCk5ldyBKZXJzZXkxFDASBgNVBAcTC0plcnNl
+eSBDaXR5MR4wHAYDVQQKExVUaGUgVVNFUlRSVVNUIE5ldHdvcmsxLjAsBgNVBAMT
+JVVTRVJUcnVzdCBFQ0MgQ2VydGlmaWNhdGlvbiBBdXRob3JpdHkwHhcNMTAwMjAx
+MDAwMDAwWhcNMzgwMTE4MjM1OTU5WjCBiDELMAkGA1UEBhMCVVMxEzARBgNVBAgT
+Ck5ldyBKZXJzZXkxFDASBgNVBAcTC0plcnNleSBDaXR5MR4wHAYDVQQKExVUaGUg
+VVNFUlRSVVNUIE5ldHdvcmsxLjAsBgNVBAMTJVVTRVJUcnVzdCBFQ0MgQ2VydGlm
+aWNhdGlvbiBBdXRob3JpdHkwdjAQBgcqhkjOPQIBBgUrgQQAIgNiAAQarFRaqflo
+I+d61SRvU8Za2EurxtW20eZzca7dnNYMYf3boIkDuAUU7FfO7l0/4iGzzvfUinng
+o4N+LZfQYcTxmdwlkWOrfzCjtHDix6EznPO/LlxTsV+zfTJ/ijTjeXmjQjBAMB0G
+A1UdDgQWBBQ64QmG1M8ZwpZ2dEl23OA1xmNjmjAOBgNVHQ8BAf8EBAMCAQYwDwYD
+VR0TAQH/BAUwAwEB/zAKBggqhkjOPQQDAwNoADBlAjA2Z6EWCNzklwBBHU6+4WMB
+zzuqQhFkoJ2UOQIReVx7Hfpkue4WQrO/isIJxOzksU0CMQDpKmFHjFJKS04YcPbW
+RNZu9YO6bVi9JNlWSOrvxKJGgYhqOkbRqZtNyWHa0V1Xahg=
+-----END CERTIFICATE-----
 )EOF";
 
 // ---- history blob
@@ -66,10 +159,32 @@ struct HistoryBlob {
   uint8_t  cpuPct[HIST_LEN];
 };
 
+// ---- history rollup tier: header + HistRollup[len]
+static const uint32_t HISTORY_TIER_MAGIC = 0xB0B0B0B1;
+
+struct HistoryTierHeader {
+  uint32_t magic;
+  uint16_t len;
+  uint16_t idx;
+  uint8_t  filled;
+  uint8_t  recSize;
+  uint8_t  rsv[2];
+};
+
 static bool storage_isReady() { return g_sdReady; }
 
+static bool storage_lock(TickType_t wait = portMAX_DELAY) {
+  if (!g_sdMutex) return true;
+  return xSemaphoreTakeRecursive(g_sdMutex, wait) == pdTRUE;
+}
+
+static void storage_unlock() {
+  if (g_sdMutex) xSemaphoreGiveRecursive(g_sdMutex);
+}
+
 static bool storage_begin(int cs, int sck, int miso, int mosi) {
   (void)sck; (void)miso; (void)mosi;
+  if (!g_sdMutex) g_sdMutex = xSemaphoreCreateRecursiveMutex();
   SdSpiConfig cfg(cs, DEDICATED_SPI, SD_SCK_MHZ(8));
   Serial.println("[SD] SdFat init...");
   g_sdReady = sd.begin(cfg);
@@ -89,11 +204,14 @@ static void storage_validateConfig(Config& cfg) {
   cfg.dryOn = constrain(cfg.dryOn, 0, 4095);
   cfg.wetOff = constrain(cfg.wetOff, 0, 4095);
   cfg.pumpPwm = constrain(cfg.pumpPwm, 0, 255);
+  cfg.rampMs = constrain(cfg.rampMs, 100UL, 10000UL);
   cfg.minOnMs = constrain(cfg.minOnMs, 1000UL, 60000UL);
   cfg.minOffMs = constrain(cfg.minOffMs, 1000UL, 60000UL);
   cfg.maxOnSecInWindow = constrain(cfg.maxOnSecInWindow, 10UL, 300UL);
   cfg.limitWindowSec = constrain(cfg.limitWindowSec, 60UL, 3600UL);
   cfg.logPeriodMs = constrain(cfg.logPeriodMs, 1000UL, 60000UL);
+  cfg.adcMedianN = constrain(cfg.adcMedianN, 1, 15) | 1;
+  cfg.adcIirPct = constrain(cfg.adcIirPct, 1, 100);
 
   // Ensure mode is valid
   if (cfg.mode > PUMP_ON) {
@@ -121,11 +239,14 @@ static bool storage_saveConfig(const Config& cfg) {
   f.printf("wetOff=%d\n", cfg.wetOff);
   f.printf("pumpPwm=%d\n", cfg.pumpPwm);
   f.printf("softRamp=%d\n", cfg.softRamp ? 1 : 0);
+  f.printf("rampMs=%lu\n", (unsigned long)cfg.rampMs);
   f.printf("minOnMs=%lu\n", (unsigned long)cfg.minOnMs);
   f.printf("minOffMs=%lu\n", (unsigned long)cfg.minOffMs);
   f.printf("limitWindowSec=%lu\n", (unsigned long)cfg.limitWindowSec);
   f.printf("maxOnSecInWindow=%lu\n", (unsigned long)cfg.maxOnSecInWindow);
   f.printf("logPeriodMs=%lu\n", (unsigned long)cfg.logPeriodMs);
+  f.printf("adcMedianN=%d\n", cfg.adcMedianN);
+  f.printf("adcIirPct=%d\n", cfg.adcIirPct);
   f.printf("mode=%d\n", (int)cfg.mode);
 
   f.close();
@@ -152,11 +273,14 @@ static bool storage_loadConfig(Config& cfg) {
     else if (k == "wetOff") cfg.wetOff = (int)iv;
     else if (k == "pumpPwm") cfg.pumpPwm = (int)iv;
     else if (k == "softRamp") cfg.softRamp = (iv != 0);
+    else if (k == "rampMs") cfg.rampMs = (uint32_t)iv;
     else if (k == "minOnMs") cfg.minOnMs = (uint32_t)iv;
     else if (k == "minOffMs") cfg.minOffMs = (uint32_t)iv;
     else if (k == "limitWindowSec") cfg.limitWindowSec = (uint32_t)iv;
     else if (k == "maxOnSecInWindow") cfg.maxOnSecInWindow = (uint32_t)iv;
     else if (k == "logPeriodMs") cfg.logPeriodMs = (uint32_t)iv;
+    else if (k == "adcMedianN") cfg.adcMedianN = (int)iv;
+    else if (k == "adcIirPct") cfg.adcIirPct = (int)iv;
     else if (k == "mode") cfg.mode = (PumpMode)iv;
   }
 
@@ -164,7 +288,7 @@ static bool storage_loadConfig(Config& cfg) {
   return true;
 }
 
-static bool storage_saveHistory(const Histories& h) {
+static bool storage_saveRawHistory(const Histories& h) {
   if (!g_sdReady) return false;
 
   HistoryBlob hb{};
@@ -184,7 +308,7 @@ static bool storage_saveHistory(const Histories& h) {
   return n == sizeof(hb);
 }
 
-static bool storage_loadHistory(Histories& h) {
+static bool storage_loadRawHistory(Histories& h) {
   if (!g_sdReady) return false;
 
   FsFile f = sd.open(PATH_HIST, O_RDONLY);
@@ -208,149 +332,679 @@ static bool storage_loadHistory(Histories& h) {
   return success;
 }
 
+template <uint16_t N>
+static bool storage_saveTier(const char* path, const HistTier<N>& t) {
+  HistoryTierHeader th{};
+  th.magic = HISTORY_TIER_MAGIC;
+  th.len = N;
+  th.idx = t.idx;
+  th.filled = t.filled ? 1 : 0;
+  th.recSize = sizeof(HistRollup);
+
+  FsFile f = sd.open(path, O_WRITE | O_CREAT | O_TRUNC);
+  if (!f) return false;
+
+  bool ok = f.write(&th, sizeof(th)) == sizeof(th) &&
+            f.write(t.buf, sizeof(t.buf)) == sizeof(t.buf);
+  f.close();
+  return ok;
+}
+
+template <uint16_t N>
+static bool storage_loadTier(const char* path, HistTier<N>& t) {
+  FsFile f = sd.open(path, O_RDONLY);
+  if (!f) return false;
+
+  HistoryTierHeader th{};
+  bool success = false;
+
+  if (f.read(&th, sizeof(th)) == sizeof(th) &&
+      th.magic == HISTORY_TIER_MAGIC && th.len == N &&
+      th.recSize == sizeof(HistRollup) && th.idx < N) {
+    if (f.read(t.buf, sizeof(t.buf)) == sizeof(t.buf)) {
+      t.idx = th.idx;
+      t.filled = th.filled != 0;
+      success = true;
+    }
+  }
+
+  f.close();
+  return success;
+}
+
+// tiers: HIST_TIER_* bits of the parts to rewrite
+static bool storage_saveHistory(const Histories& h, uint8_t tiers) {
+  if (!g_sdReady) return false;
+
+  bool ok = true;
+  if (tiers & HIST_TIER_RAW)  ok &= storage_saveRawHistory(h);
+  if (tiers & HIST_TIER_MIN)  ok &= storage_saveTier(PATH_HIST_MIN, h.minute);
+  if (tiers & HIST_TIER_HOUR) ok &= storage_saveTier(PATH_HIST_HOUR, h.hour);
+  return ok;
+}
+
+static bool storage_loadHistory(Histories& h) {
+  if (!g_sdReady) return false;
+
+  bool raw = storage_loadRawHistory(h);
+  if (!storage_loadTier(PATH_HIST_MIN, h.minute)) h.minute = HistTier<HIST_MIN_LEN>{};
+  if (!storage_loadTier(PATH_HIST_HOUR, h.hour)) h.hour = HistTier<HIST_HOUR_LEN>{};
+
+  // Loaded entries are numbered 1..count; clients tell boots apart by boot id
+  h.seq = history_count(h.idx, h.filled, HIST_LEN);
+  h.minute.seq = history_count(h.minute.idx, h.minute.filled, HIST_MIN_LEN);
+  h.hour.seq = history_count(h.hour.idx, h.hour.filled, HIST_HOUR_LEN);
+  return raw;
+}
+
+// ---- Log writer
+// Records are staged in RAM (logbuf.h) and written to the kept-open,
+// pre-allocated current segment in sector-aligned batches by storage_flushLog().
+static const uint32_t LOG_SEG_BYTES = sizeof(LogSegHeader) + LOGSEG_MAX_RECORDS * sizeof(LogRecord);
+
+static LogBuf g_logBuf;
+static FsFile g_logFile;
+static uint32_t g_logBootId = 0;
+static uint32_t g_logSegNo = 0;       // current segment, 0 = none yet
+static uint32_t g_logSegCount = 0;    // records in it, buffered ones included
+static uint32_t g_logIndexPos = 0;    // its entry in the index file
+static LogIndexEntry g_logSegEntry;
+
+static void storage_logSegPath(uint32_t segNo, char* buf, size_t size) {
+  snprintf(buf, size, "%s/%08lu.bin", LOG_DIR, (unsigned long)segNo);
+}
+
+// Unix time once NTP has synced (net.h), else 0
+static uint32_t storage_epochNow() {
+  time_t t = time(nullptr);
+  return t > 1600000000 ? (uint32_t)t : 0;
+}
+
+static void storage_writeIndexEntry(const LogIndexEntry& e, uint32_t pos) {
+  FsFile f = sd.open(PATH_LOG_INDEX, O_RDWR | O_CREAT);
+  if (!f) return;
+  f.seekSet(pos);
+  f.write(&e, sizeof(e));
+  f.close();
+}
+
+// Opens a fresh segment after the highest one in the index
+static bool storage_openSegment() {
+  FsFile idx = sd.open(PATH_LOG_INDEX, O_RDONLY);
+  uint32_t lastSeg = 0;
+  g_logIndexPos = 0;
+  if (idx) {
+    uint32_t n = idx.size() / sizeof(LogIndexEntry);
+    g_logIndexPos = n * sizeof(LogIndexEntry);
+    LogIndexEntry e;
+    if (n > 0 && idx.seekSet((n - 1) * sizeof(LogIndexEntry)) && idx.read(&e, sizeof(e)) == sizeof(e)) {
+      lastSeg = e.segNo;
+    }
+    idx.close();
+  }
+
+  g_logSegNo = max(lastSeg, g_logSegNo) + 1;
+  char path[32];
+  storage_logSegPath(g_logSegNo, path, sizeof(path));
+
+  g_logFile = sd.open(path, O_RDWR | O_CREAT | O_TRUNC);
+  if (!g_logFile) return false;
+
+  // Contiguous clusters up front: appends never walk or extend the FAT
+  g_logFile.preAllocate(LOG_SEG_BYTES);
+
+  LogSegHeader h{};
+  h.magic = LOGSEG_MAGIC;
+  h.version = LOGSEG_VERSION;
+  h.recordSize = sizeof(LogRecord);
+  h.bootId = g_logBootId;
+  h.segNo = g_logSegNo;
+  h.epochStart = storage_epochNow();
+  h.msStart = millis();
+  g_logFile.write(&h, sizeof(h));
+  g_logFile.sync();
+
+  g_logSegCount = 0;
+  g_logSegEntry = LogIndexEntry{};
+  g_logSegEntry.segNo = g_logSegNo;
+  g_logSegEntry.bootId = g_logBootId;
+  storage_writeIndexEntry(g_logSegEntry, g_logIndexPos);
+
+  Serial.printf("[LOG] segment %s (boot %lu)\n", path, (unsigned long)g_logBootId);
+  return true;
+}
+
+static bool storage_openLog() {
+  if (g_logFile.isOpen()) return true;
+  if (g_logSegNo != 0) {
+    char path[32];
+    storage_logSegPath(g_logSegNo, path, sizeof(path));
+    if (sd.exists(path)) {
+      // Not O_APPEND: that would also move the seal's header rewrite to the end
+      g_logFile = sd.open(path, O_RDWR);
+      if (g_logFile && g_logFile.seekEnd()) return true;
+      if (g_logFile) g_logFile.close();
+    }
+  }
+  return storage_openSegment();
+}
+
+// Writes whatever is due (everything if force); call regularly
+static void storage_flushLog(bool force = false) {
+  if (!g_sdReady) return;
+  storage_lock();
+
+  if (logbuf_due(g_logBuf, 0, millis(), force) > 0 && storage_openLog()) {
+    size_t n = logbuf_due(g_logBuf, g_logFile.curPosition(), millis(), force);
+    if (n > 0 && g_logFile.write(g_logBuf.data, n) == n) {
+      g_logFile.sync();  // one directory update per batch
+      logbuf_consume(g_logBuf, n);
+    }
+  }
+
+  storage_unlock();
+}
+
+// Flush and release the file (before restart/OTA, or before it is deleted)
+static void storage_closeLog() {
+  if (!g_sdReady) return;
+  storage_lock();
+  storage_flushLog(true);
+  if (g_logFile.isOpen()) g_logFile.close();
+  storage_unlock();
+}
+
+// Final count in the header and index, then start the next segment
+static void storage_sealSegment() {
+  storage_flushLog(true);
+  if (!storage_openLog()) return;
+
+  LogSegHeader h;
+  if (g_logFile.seekSet(0) && g_logFile.read(&h, sizeof(h)) == sizeof(h)) {
+    h.recordCount = g_logSegCount;
+    h.flags |= LOGSEG_FLAG_SEALED;
+    g_logFile.seekSet(0);
+    g_logFile.write(&h, sizeof(h));
+  }
+  g_logFile.close();
+
+  g_logSegEntry.count = g_logSegCount;
+  g_logSegEntry.flags |= LOGSEG_FLAG_SEALED;
+  storage_writeIndexEntry(g_logSegEntry, g_logIndexPos);
+
+  storage_openSegment();
+}
+
+// New boot id and a new segment; call once after storage_begin()
+// Changes on every boot with a card; 0 without one
+static uint32_t storage_bootId() { return g_logBootId; }
+
+static void storage_logBegin() {
+  if (!g_sdReady) return;
+  if (!sd.exists(LOG_DIR)) sd.mkdir(LOG_DIR);
+
+  FsFile f = sd.open(PATH_BOOT_ID, O_RDWR | O_CREAT);
+  if (f) {
+    uint32_t id = 0;
+    if (f.read(&id, sizeof(id)) != sizeof(id)) id = 0;
+    g_logBootId = id + 1;
+    f.seekSet(0);
+    f.write(&g_logBootId, sizeof(g_logBootId));
+    f.close();
+  }
+
+  storage_openSegment();
+}
+
 static void storage_appendLog(const Runtime& rt) {
   if (!g_sdReady) return;
+  storage_lock();
 
-  bool exists = sd.exists(PATH_LOG);
-  FsFile f = sd.open(PATH_LOG, O_WRITE | O_CREAT | O_APPEND);
-  if (!f) return;
+  if (g_logSegCount >= LOGSEG_MAX_RECORDS) storage_sealSegment();
 
-  if (!exists) {
-    f.println("ms,soil,tempC_x10,cpuPct,pumpOn,lockout,onTimeWindowMs");
+  LogRecord r = logfmt_record(rt, storage_epochNow(), millis());
+  if (logbuf_append(g_logBuf, (const char*)&r, sizeof(r), millis())) {
+    g_logSegCount++;
+    if (r.epoch) {
+      if (!g_logSegEntry.epochFirst) g_logSegEntry.epochFirst = r.epoch;
+      g_logSegEntry.epochLast = r.epoch;
+    }
   }
+  storage_flushLog();
 
-  f.printf("%lu,%d,%d,%u,%d,%d,%lu\n",
-           (unsigned long)millis(),
-           rt.soilNow,
-           (int)rt.tempC_x10,
-           (unsigned)rt.cpuPct,
-           rt.pumpOn ? 1 : 0,
-           rt.lockout ? 1 : 0,
-           (unsigned long)rt.onTimeThisWindowMs);
+  storage_unlock();
+}
 
-  f.close();
+// ---- Log query
+// Resumable read of every flushed record with from <= epoch <= to, oldest
+// first; from == 0 also includes records logged before the clock was set.
+// Segments are skipped by index, and entered by binary search. The cursor
+// keeps its files open between reads, so a response can be produced in
+// pieces as the client takes them.
+struct LogCursor {
+  uint32_t from;
+  uint32_t to;
+  FsFile   idx;
+  uint32_t entry;    // next index entry to look at
+  uint32_t entries;
+  FsFile   seg;      // open segment, positioned at record n
+  uint32_t n;
+  uint32_t count;
+  bool     done;
+};
+
+static void storage_logCursorBegin(LogCursor& c, uint32_t from, uint32_t to) {
+  c.from = from;
+  c.to = to;
+  c.entry = 0;
+  c.entries = 0;
+  c.n = 0;
+  c.count = 0;
+  c.done = !g_sdReady;
+  if (c.done) return;
+
+  storage_lock();
+  storage_flushLog(true);
+  c.idx = sd.open(PATH_LOG_INDEX, O_RDONLY);
+  c.entries = c.idx ? c.idx.size() / sizeof(LogIndexEntry) : 0;
+  storage_unlock();
 }
 
-// ----- GitHub web UI cache: download file in chunks
-// Downloads in 4KB chunks with delays to avoid watchdog timeout
-static bool storage_downloadToFile(const String& url, const char* outPath, uint32_t timeoutMs = 30000) {
-  if (!g_sdReady) return false;
+// Opens the next segment that may hold matching records; false when none left
+static bool storage_logCursorNextSeg(LogCursor& c) {
+  if (c.seg) c.seg.close();
+
+  while (c.entry < c.entries) {
+    LogIndexEntry e;
+    uint32_t i = c.entry++;
+    if (!c.idx.seekSet(i * sizeof(LogIndexEntry)) || c.idx.read(&e, sizeof(e)) != sizeof(e)) break;
+
+    bool sealed = e.flags & LOGSEG_FLAG_SEALED;
+    if (sealed && c.from > 0 && (e.epochFirst == 0 || e.epochLast < c.from || e.epochFirst > c.to)) continue;
+
+    char path[32];
+    storage_logSegPath(e.segNo, path, sizeof(path));
+    c.seg = sd.open(path, O_RDONLY);
+    if (!c.seg) continue;
+
+    c.count = sealed ? e.count : (c.seg.size() - sizeof(LogSegHeader)) / sizeof(LogRecord);
+    if (c.seg.size() < sizeof(LogSegHeader)) c.count = 0;
+
+    auto readAt = [&](uint32_t n, LogRecord& r) {
+      return c.seg.seekSet(sizeof(LogSegHeader) + n * sizeof(LogRecord)) &&
+             c.seg.read(&r, sizeof(r)) == sizeof(r);
+    };
+    c.n = c.from ? logfmt_lowerBound(readAt, c.count, c.from) : 0;
+    c.seg.seekSet(sizeof(LogSegHeader) + c.n * sizeof(LogRecord));
+    return true;
+  }
+  return false;
+}
 
-  WiFiClientSecure client;
-  client.setInsecure();
-  client.setTimeout(10);
+// Up to max matching records into out; 0 once the query is exhausted
+static uint32_t storage_logCursorRead(LogCursor& c, LogRecord* out, uint32_t max) {
+  uint32_t got = 0;
+  if (c.done) return 0;
+  storage_lock();
+
+  while (got == 0 && !c.done) {
+    if (!c.seg || c.n >= c.count) {
+      if (!storage_logCursorNextSeg(c)) {
+        c.done = true;
+        break;
+      }
+      continue;
+    }
+    uint32_t want = min(c.count - c.n, max);
+    int bytes = c.seg.read(out, want * sizeof(LogRecord));
+    if (bytes <= 0) {
+      c.n = c.count;  // unreadable: skip the rest of this segment
+      continue;
+    }
+    uint32_t recs = (uint32_t)bytes / sizeof(LogRecord);
+    c.n += recs;
+    for (uint32_t k = 0; k < recs; k++) {
+      if (out[k].epoch > c.to) {
+        c.done = true;
+        break;
+      }
+      got++;
+    }
+  }
+
+  storage_unlock();
+  return got;
+}
+
+static void storage_logCursorEnd(LogCursor& c) {
+  storage_lock();
+  if (c.seg) c.seg.close();
+  if (c.idx) c.idx.close();
+  storage_unlock();
+  c.done = true;
+}
+
+// ----- Web UI sync progress, for /api/webui/status. Written only by the
+// sync, read by the web handlers.
+enum WebuiSyncState : uint8_t {
+  WEBUI_IDLE = 0,
+  WEBUI_CHECKING,
+  WEBUI_STAGING,
+  WEBUI_SWAPPING,
+  WEBUI_UPDATED,
+  WEBUI_UP_TO_DATE,
+  WEBUI_FAILED
+};
 
+static const char* const WEBUI_STATE_NAMES[] = {
+  "idle", "checking", "staging", "swapping", "updated", "upToDate", "failed"
+};
+
+struct WebuiProgress {
+  volatile uint8_t  state;
+  volatile uint8_t  file;      // WEB_FILES index being staged
+  volatile uint8_t  fetched;   // files downloaded so far
+};
+
+static WebuiProgress g_webuiProgress;
+
+// ----- GitHub web UI cache: streaming download
+// One TLS connection serves a whole update: HTTPClient keeps it open between
+// requests (setReuse) while the server allows keep-alive, so the version
+// check and every file share one handshake. The session is torn down with
+// storage_dlEnd() when the update is over, which returns its ~40 KB of
+// TLS buffers to the heap.
+#define DL_BLOCK      4096   // card write size, a sector multiple
+#define DL_STALL_MS   10000  // no data this long = connection lost
+#define DL_RESUMES    3      // reconnects per file after a lost connection
+
+struct DlSession {
+  WiFiClientSecure client;
   HTTPClient http;
-  http.setTimeout(10000);
+};
 
-  if (!http.begin(client, url)) {
-    Serial.println("[SD] HTTP begin failed");
-    return false;
+static DlSession* g_dl = nullptr;
+
+static DlSession& storage_dlSession() {
+  if (!g_dl) {
+    g_dl = new DlSession();
+    g_dl->client.setCACert(GITHUB_ROOT_CA);  // firmware.json carries the hashes we trust
+    g_dl->client.setTimeout(10);
+    g_dl->http.setReuse(true);
+    g_dl->http.setTimeout(10000);
   }
+  return *g_dl;
+}
 
-  // Get file size first with HEAD request
-  const char* hdrs[] = {"Content-Length"};
-  http.collectHeaders(hdrs, 1);
+static void storage_dlEnd() {
+  if (!g_dl) return;
+  g_dl->http.end();
+  g_dl->client.stop();
+  delete g_dl;
+  g_dl = nullptr;
+}
 
-  int code = http.GET();
-  if (code != 200) {
-    Serial.printf("[SD] HTTP GET failed: %d\n", code);
-    http.end();
-    return false;
+// The session serves one job at a time (web UI sync or firmware staging):
+// a job starts only if it can acquire it and releases it when done.
+static volatile bool g_dlOwned = false;
+static portMUX_TYPE g_dlMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Stop requests for the owner (WiFi lost, POST /api/webui/cancel). Its
+// retry waits block on the event group, so a stop ends them at once.
+#define DL_STOP_BIT  BIT0
+static EventGroupHandle_t g_dlEvents = nullptr;
+
+static bool storage_dlAcquire() {
+  portENTER_CRITICAL(&g_dlMux);
+  bool free = !g_dlOwned;
+  g_dlOwned = true;
+  portEXIT_CRITICAL(&g_dlMux);
+  if (free) {
+    if (!g_dlEvents) g_dlEvents = xEventGroupCreate();
+    if (g_dlEvents) xEventGroupClearBits(g_dlEvents, DL_STOP_BIT);
   }
+  return free;
+}
 
-  size_t totalSize = http.getSize();
-  http.end();
+static void storage_dlRelease() {
+  storage_dlEnd();
+  g_dlOwned = false;
+}
+
+// Asks the current job, if any, to give up
+static void storage_dlStop() {
+  if (g_dlOwned && g_dlEvents) xEventGroupSetBits(g_dlEvents, DL_STOP_BIT);
+}
 
-  if (totalSize <= 0) {
-    Serial.println("[SD] Unknown file size");
+static bool storage_dlStopped() {
+  return g_dlEvents && (xEventGroupGetBits(g_dlEvents) & DL_STOP_BIT);
+}
+
+// Waits ms before a retry; true if the job was stopped meanwhile
+static bool storage_dlWait(uint32_t ms) {
+  if (!g_dlEvents) {
+    delay(ms);
     return false;
   }
+  return xEventGroupWaitBits(g_dlEvents, DL_STOP_BIT, pdFALSE, pdFALSE, pdMS_TO_TICKS(ms)) & DL_STOP_BIT;
+}
 
-  Serial.printf("[SD] File size: %u bytes\n", (unsigned)totalSize);
-
-  // Download in chunks using Range requests
-  const size_t CHUNK_SIZE = 4096;
-  size_t downloaded = 0;
+// Current download, for the status APIs
+struct DlProgress {
+  volatile uint32_t bytes;
+  volatile uint32_t total;
+};
 
-  FsFile f = sd.open(outPath, O_WRITE | O_CREAT | O_TRUNC);
+static DlProgress g_dlProgress;
+
+// Streams url into outPath with a single GET. Data is gathered into DL_BLOCK
+// pieces and each is written to the card under the lock while lwIP keeps
+// receiving into the TCP window behind it. Only a dropped connection
+// resumes, with a Range request from the last byte received; HTTP errors
+// fail at once. The watchdog is fed per read instead of sleeping.
+// With sha256 set, the SHA-256 of the body is computed on the way through.
+// With resume set, bytes already in outPath are kept (and hashed again) and
+// the download continues after them, so an interrupted transfer can be
+// picked up by a later call; a server that ignores the Range gets a restart.
+static bool storage_downloadToFile(const String& url, const char* outPath, uint32_t timeoutMs = 30000,
+                                   uint8_t* sha256 = nullptr, bool resume = false) {
+  if (!g_sdReady) return false;
+  DlSession& s = storage_dlSession();
+
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  g_dlProgress.bytes = 0;
+  g_dlProgress.total = 0;
+
+  static uint8_t block[DL_BLOCK];  // static: keeps it off the net task stack
+  size_t fill = 0;                 // bytes in block not yet on the card
+  size_t got = 0;                  // bytes received (or kept from before)
+  size_t total = 0;                // 0 until the first response
+  uint32_t startMs = millis();
+  bool ok = false;
+
+  storage_lock();
+  FsFile f = sd.open(outPath, resume ? (O_RDWR | O_CREAT) : (O_WRITE | O_CREAT | O_TRUNC));
+  storage_unlock();
   if (!f) {
     Serial.println("[SD] File open failed");
     return false;
   }
+  for (int n = 1; resume && n > 0;) {
+    esp_task_wdt_reset();
+    storage_lock();
+    n = f.read(block, sizeof(block));
+    storage_unlock();
+    if (n > 0) {
+      mbedtls_sha256_update(&sha, block, n);
+      got += n;
+    }
+  }
+  if (got) Serial.printf("[SD] resuming %s at %u bytes\n", outPath, (unsigned)got);
 
-  while (downloaded < totalSize) {
-    size_t chunkEnd = min(downloaded + CHUNK_SIZE - 1, totalSize - 1);
-
-    // Create new connection for each chunk
-    WiFiClientSecure chunkClient;
-    chunkClient.setInsecure();
-    chunkClient.setTimeout(10);
-
-    HTTPClient chunkHttp;
-    chunkHttp.setTimeout(10000);
-
-    if (!chunkHttp.begin(chunkClient, url)) {
-      Serial.println("[SD] Chunk HTTP begin failed");
-      f.close();
-      return false;
+  for (int resumes = 0;; resumes++) {
+    if (!s.http.begin(s.client, url)) {
+      Serial.println("[SD] HTTP begin failed");
+      break;
+    }
+    if (got > 0) {
+      char range[32];
+      snprintf(range, sizeof(range), "bytes=%u-", (unsigned)got);
+      s.http.addHeader("Range", range);
     }
 
-    // Request specific byte range
-    char rangeHeader[32];
-    snprintf(rangeHeader, sizeof(rangeHeader), "bytes=%u-%u", (unsigned)downloaded, (unsigned)chunkEnd);
-    chunkHttp.addHeader("Range", rangeHeader);
+    int code = s.http.GET();
+    if (code == 200 && got > 0 && total == 0) {
+      // Range ignored on a resumed file: start it over
+      storage_lock();
+      f.truncate(0);
+      storage_unlock();
+      got = 0;
+      mbedtls_sha256_starts(&sha, 0);
+    } else if (code == 416 && got > 0) {
+      // Kept bytes run past the end (the file changed upstream): start it over
+      Serial.printf("[SD] %s past the end at %u bytes, restarting\n", outPath, (unsigned)got);
+      s.http.end();
+      storage_lock();
+      f.truncate(0);
+      storage_unlock();
+      got = total = 0;
+      g_dlProgress.bytes = g_dlProgress.total = 0;
+      mbedtls_sha256_starts(&sha, 0);
+      continue;
+    } else if (code > 0 && code != (got ? 206 : 200)) {
+      Serial.printf("[SD] HTTP GET failed: %d\n", code);
+      break;
+    }
 
-    int chunkCode = chunkHttp.GET();
-    if (chunkCode != 200 && chunkCode != 206) {
-      Serial.printf("[SD] Chunk GET failed: %d\n", chunkCode);
-      chunkHttp.end();
-      f.close();
-      return false;
+    if (code > 0 && total == 0) {
+      int len = s.http.getSize();
+      if (len <= 0) {
+        Serial.println("[SD] Unknown file size");
+        break;
+      }
+      total = got + len;
+      g_dlProgress.total = total;
+      Serial.printf("[SD] File size: %u bytes\n", (unsigned)total);
     }
 
-    // Read chunk data
-    WiFiClient* stream = chunkHttp.getStreamPtr();
-    uint8_t buf[512];
-    size_t chunkDownloaded = 0;
-    size_t expectedChunk = chunkEnd - downloaded + 1;
-
-    while (chunkDownloaded < expectedChunk && stream->connected()) {
-      int avail = stream->available();
-      if (avail > 0) {
-        int n = stream->readBytes((char*)buf, min((size_t)avail, sizeof(buf)));
-        if (n > 0) {
-          f.write(buf, n);
-          chunkDownloaded += n;
+    bool writeErr = false;
+    if (code > 0) {
+      WiFiClient* stream = s.http.getStreamPtr();
+      uint32_t lastDataMs = millis();
+      while (got < total && millis() - startMs < timeoutMs && !storage_dlStopped()) {
+        esp_task_wdt_reset();
+        int avail = stream->available();
+        if (avail <= 0) {
+          if (!stream->connected() || millis() - lastDataMs > DL_STALL_MS) break;
+          vTaskDelay(1);
+          continue;
+        }
+
+        size_t want = min((size_t)avail, min(DL_BLOCK - fill, total - got));
+        int n = stream->read(block + fill, want);
+        if (n <= 0) continue;
+        mbedtls_sha256_update(&sha, block + fill, n);
+        fill += n;
+        got += n;
+        g_dlProgress.bytes = got;
+        lastDataMs = millis();
+
+        if (fill == DL_BLOCK || got == total) {
+          storage_lock();
+          writeErr = f.write(block, fill) != fill;
+          storage_unlock();
+          fill = 0;
+          if (writeErr) break;
         }
-      } else {
-        delay(5);
       }
     }
 
-    chunkHttp.end();
-    downloaded += chunkDownloaded;
+    // What arrived but is not on the card yet stays valid for the Range
+    if (fill && !writeErr) {
+      storage_lock();
+      writeErr = f.write(block, fill) != fill;
+      storage_unlock();
+      fill = 0;
+    }
+
+    if (got == total && total > 0) {
+      ok = true;
+      break;
+    }
+    if (writeErr) {
+      Serial.println("[SD] write failed");
+      break;
+    }
+    if (resumes >= DL_RESUMES || millis() - startMs >= timeoutMs || storage_dlStopped()) {
+      Serial.printf("[SD] giving up at %u/%u bytes\n", (unsigned)got, (unsigned)total);
+      break;
+    }
 
-    // Progress and yield between chunks
-    Serial.printf("[SD] %u/%u bytes\n", (unsigned)downloaded, (unsigned)totalSize);
-    delay(50);  // Give system time between chunks
+    // Lost connection: drop it (it cannot be reused) and pick up where it broke
+    Serial.printf("[SD] connection lost at %u/%u bytes, resuming\n", (unsigned)got, (unsigned)total);
+    s.http.end();
+    s.client.stop();
   }
 
+  if (ok) s.http.end();  // body fully read: the connection stays open for the next file
+  else storage_dlEnd();
+
+  storage_lock();
+  f.close();
+  storage_unlock();
+  if (ok && sha256) mbedtls_sha256_finish(&sha, sha256);
+  mbedtls_sha256_free(&sha);
+  Serial.printf("[SD] Downloaded %u bytes\n", (unsigned)got);
+  return ok;
+}
+
+// SHA-256 of a file on the card, read a block at a time; false if unreadable
+static bool storage_hashFile(const char* path, uint8_t* sha256, size_t* size = nullptr) {
+  static uint8_t buf[DL_BLOCK];
+  storage_lock();
+  FsFile f = sd.open(path, O_RDONLY);
+  storage_unlock();
+  if (!f) return false;
+
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  size_t total = 0;
+  int n;
+  do {
+    esp_task_wdt_reset();
+    storage_lock();
+    n = f.read(buf, sizeof(buf));
+    storage_unlock();
+    if (n > 0) {
+      mbedtls_sha256_update(&sha, buf, n);
+      total += n;
+    }
+  } while (n > 0);
+  mbedtls_sha256_finish(&sha, sha256);
+  mbedtls_sha256_free(&sha);
+
+  storage_lock();
   f.close();
-  Serial.printf("[SD] Downloaded %u bytes\n", (unsigned)downloaded);
-  return downloaded == totalSize;
+  storage_unlock();
+  if (size) *size = total;
+  return n == 0;
 }
 
-// Web UI files to download from GitHub
+// Web UI files to download from GitHub. The card holds the gzip variants
+// (webui/*.gz, built with `gzip -9 -n -k`); web.h serves them as-is.
 static const char* WEB_FILES[] = {
-  "index.html",
-  "app.js",
-  "style.css"
+  "index.html.gz",
+  "app.js.gz",
+  "style.css.gz"
 };
 static const int WEB_FILES_COUNT = 3;
 
-// Expected file sizes (parsed from firmware.json)
+// Expected file sizes and SHA-256 (hex, "" if not listed), parsed from firmware.json
 static size_t g_webFileSizes[3] = {0, 0, 0};
+static char g_webFileSha[3][65];
 
 // firmware.json URL for version checking
 static const char* FIRMWARE_JSON_URL =
@@ -359,11 +1013,25 @@ static const char* FIRMWARE_JSON_URL =
 // Local webui version stored on SD
 static const char* LOCAL_WEBUI_VERSION_FILE = "/web/.version";
 
-static void storage_downloadWebFile(const char* filename, bool wifiUp) {
-  if (!wifiUp) return;
+// Updates are assembled here and swapped in whole (storage_webSwap)
+static const char* WEB_STAGE_DIR = "/web.new";
+static const char* WEB_OLD_DIR   = "/web.old";
 
-  char localPath[32];
-  snprintf(localPath, sizeof(localPath), "/web/%s", filename);
+// Version of the files being served ("" = unknown); the web UI's ETags
+static char g_webuiVersion[16] = "";
+
+static const char* storage_webuiVersion() {
+  return g_webuiVersion;
+}
+
+// Files under /web were edited by hand: the version no longer describes them
+static void storage_forgetWebuiVersion() {
+  g_webuiVersion[0] = 0;
+}
+
+static bool storage_downloadWebFile(const char* filename, const char* dir, uint8_t* sha256) {
+  char localPath[40];
+  snprintf(localPath, sizeof(localPath), "%s/%s", dir, filename);
 
   String url = String(GH_WEB_BASE) + "/" + filename;
   Serial.print("[SD] downloading ");
@@ -373,34 +1041,97 @@ static void storage_downloadWebFile(const char* filename, bool wifiUp) {
   for (int attempt = 0; attempt < 3; attempt++) {
     if (attempt > 0) {
       Serial.printf("[SD] retry %d...\n", attempt);
-      delay(2000);  // Wait before retry
+      if (storage_dlWait(2000)) break;
     }
 
-    if (storage_downloadToFile(url, localPath, 30000)) {  // 30 second timeout
+    if (storage_downloadToFile(url, localPath, 30000, sha256)) {  // 30 second timeout
       Serial.printf("[SD] %s OK\n", filename);
-      return;
+      return true;
     }
   }
 
-  Serial.printf("[SD] %s FAIL after 3 attempts\n", filename);
+  if (storage_dlStopped()) Serial.printf("[SD] %s stopped\n", filename);
+  else Serial.printf("[SD] %s FAIL after 3 attempts\n", filename);
+  return false;
 }
 
-// Parse file size from JSON for a specific file
-// Looks for "filename": size pattern
-static size_t storage_parseFileSize(const String& json, const char* filename) {
-  String pattern = String("\"") + filename + "\"";
-  int idx = json.indexOf(pattern);
-  if (idx < 0) return 0;
+// ---- firmware.json
+// One parsed copy serves the web UI sync and the firmware updater. It is
+// fetched over the download session with If-None-Match, so while the file
+// is unchanged GitHub answers 304 without a body and the copy is reused:
+// a check costs one small round trip. The body streams through
+// ManifestSink into the tokenizer (manifest.h) and is never held whole.
+// Only the session owner fetches or reads it (storage_dlAcquire).
+static Manifest g_manifest;
+static bool g_manifestValid = false;
+static char g_manifestEtag[80] = "";
+
+// writeToStream() target: HTTPClient undoes chunked encoding before this
+class ManifestSink : public Stream {
+ public:
+  explicit ManifestSink(Manifest& m) : m_(m) { manifest_begin(tok_, m_); }
+  size_t write(uint8_t c) override {
+    manifest_feed(tok_, m_, (char)c);
+    return 1;
+  }
+  size_t write(const uint8_t* buf, size_t n) override {
+    for (size_t i = 0; i < n; i++) manifest_feed(tok_, m_, (char)buf[i]);
+    return n;
+  }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  bool ok() { return manifest_end(tok_, m_); }
+
+ private:
+  JsonTok tok_;
+  Manifest& m_;
+};
 
-  // Find the colon after filename
-  int colonIdx = json.indexOf(":", idx);
-  if (colonIdx < 0) return 0;
+// Current firmware.json, or nullptr if it could not be fetched
+static const Manifest* storage_fetchManifest() {
+  DlSession& s = storage_dlSession();
 
-  // Parse the number after colon
-  int start = colonIdx + 1;
-  while (start < (int)json.length() && (json[start] == ' ' || json[start] == '\t')) start++;
+  Serial.print("[SD] Fetching firmware.json...");
 
-  return (size_t)json.substring(start).toInt();
+  if (!s.http.begin(s.client, FIRMWARE_JSON_URL)) {
+    Serial.println(" begin failed");
+    return nullptr;
+  }
+  static const char* headers[] = {"ETag"};
+  s.http.collectHeaders(headers, 1);
+  if (g_manifestValid && g_manifestEtag[0]) s.http.addHeader("If-None-Match", g_manifestEtag);
+
+  int code = s.http.GET();
+  if (code == 304 && g_manifestValid) {
+    s.http.end();
+    Serial.println(" not modified");
+    return &g_manifest;
+  }
+  if (code != 200) {
+    Serial.printf(" HTTP %d\n", code);
+    storage_dlEnd();
+    return nullptr;
+  }
+
+  strlcpy(g_manifestEtag, s.http.header("ETag").c_str(), sizeof(g_manifestEtag));
+  ManifestSink sink(g_manifest);
+  int n = s.http.writeToStream(&sink);
+  s.http.end();
+
+  g_manifestValid = n > 0 && sink.ok();
+  if (!g_manifestValid) {
+    g_manifestEtag[0] = 0;
+    Serial.printf(" unreadable (%d)\n", n);
+    storage_dlEnd();
+    return nullptr;
+  }
+  Serial.printf(" OK (%d bytes)\n", n);
+  return &g_manifest;
+}
+
+static void storage_shaHex(const uint8_t* sha256, char* hex) {
+  for (int i = 0; i < 32; i++) snprintf(hex + 2 * i, 3, "%02x", sha256[i]);
 }
 
 // Compare version strings (e.g., "1.0" < "1.1" < "2.0")
@@ -435,76 +1166,178 @@ static String storage_getLocalWebuiVersion() {
   return ver.length() > 0 ? ver : "0.0";
 }
 
-// Save local webui version to SD
-static void storage_saveLocalWebuiVersion(const String& version) {
-  if (!g_sdReady) return;
-
-  FsFile f = sd.open(LOCAL_WEBUI_VERSION_FILE, O_WRITE | O_CREAT | O_TRUNC);
-  if (!f) return;
-
-  f.print(version);
-  f.close();
-}
-
-// Fetch webui version from firmware.json on GitHub
-// Parses "webui":{"version":"X.Y", "files":{"name":size,...}}
-// Also populates g_webFileSizes array with expected sizes
+// Web UI version from firmware.json ("" if it could not be fetched).
+// Also fills g_webFileSizes and g_webFileSha with what the files should be.
 static String storage_getRemoteWebuiVersion(bool wifiUp) {
   if (!wifiUp) return "";
 
-  WiFiClientSecure client;
-  // Skip SSL verification for now (GitHub certs change frequently)
-  client.setInsecure();
-  client.setTimeout(10);
+  const Manifest* m = storage_fetchManifest();
+  if (!m || !m->webui.version[0]) return "";
 
-  HTTPClient http;
-  http.setTimeout(10000);
+  for (int i = 0; i < WEB_FILES_COUNT; i++) {
+    const ManifestWebFile* wf = manifest_webFile(*m, WEB_FILES[i]);
+    g_webFileSizes[i] = wf ? wf->size : 0;
+    strlcpy(g_webFileSha[i], wf ? wf->sha256 : "", sizeof(g_webFileSha[i]));
+    Serial.printf("[SD] Expected %s: %u bytes, sha256 %.8s\n", WEB_FILES[i], (unsigned)g_webFileSizes[i],
+                  g_webFileSha[i][0] ? g_webFileSha[i] : "-");
+  }
 
-  Serial.print("[SD] Fetching firmware.json...");
+  return m->webui.version;
+}
 
-  if (!http.begin(client, FIRMWARE_JSON_URL)) {
-    Serial.println(" begin failed");
-    return "";
+// ---- Staged web UI update
+// An update is assembled in WEB_STAGE_DIR. Files whose hash still matches
+// are copied from the live /web (and re-hashed on the way); the others are
+// downloaded and hashed while streaming. Only a complete, verified tree is
+// swapped in, so the live UI is never half-updated, and an update that
+// fails leaves it untouched. The staged .version is written last and marks
+// the tree complete. The card is locked per step, never across a download,
+// so logging and the web server carry on while the UI syncs.
+
+// Removes a flat directory (the UI trees have no subdirectories)
+static void storage_rmTree(const char* path) {
+  if (!sd.exists(path)) return;
+  FsFile dir = sd.open(path, O_RDONLY);
+  FsFile e;
+  char name[64];
+  char child[96];
+  while (dir && e.openNext(&dir, O_RDONLY)) {
+    e.getName(name, sizeof(name));
+    e.close();
+    snprintf(child, sizeof(child), "%s/%s", path, name);
+    sd.remove(child);
   }
+  dir.close();
+  sd.rmdir(path);
+}
 
-  int code = http.GET();
-  if (code != 200) {
-    Serial.printf(" HTTP %d\n", code);
-    http.end();
-    return "";
+// Copies src to dst, hashing the bytes; false if either cannot be opened
+static bool storage_copyFile(const char* src, const char* dst, uint8_t* sha256) {
+  FsFile in = sd.open(src, O_RDONLY);
+  if (!in) return false;
+  FsFile out = sd.open(dst, O_WRITE | O_CREAT | O_TRUNC);
+  if (!out) {
+    in.close();
+    return false;
   }
 
-  String json = http.getString();
-  http.end();
-  Serial.println(" OK");
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  uint8_t buf[512];
+  bool ok = true;
+  int n;
+  while ((n = in.read(buf, sizeof(buf))) > 0) {
+    mbedtls_sha256_update(&sha, buf, n);
+    if (out.write(buf, n) != (size_t)n) {
+      ok = false;
+      break;
+    }
+  }
+  ok = ok && n == 0;
+  mbedtls_sha256_finish(&sha, sha256);
+  mbedtls_sha256_free(&sha);
+  in.close();
+  out.close();
+  return ok;
+}
+
+// Finishes or rolls back a swap cut short by a reset, then clears leftovers
+static void storage_webRecover() {
+  if (!sd.exists(WEB_DIR)) {
+    char staged[32];
+    snprintf(staged, sizeof(staged), "%s/.version", WEB_STAGE_DIR);
+    if (sd.exists(staged)) sd.rename(WEB_STAGE_DIR, WEB_DIR);
+    else if (sd.exists(WEB_OLD_DIR)) sd.rename(WEB_OLD_DIR, WEB_DIR);
+  }
+  storage_rmTree(WEB_OLD_DIR);
+  storage_rmTree(WEB_STAGE_DIR);
+}
 
-  // Simple parse: find "webui" then "version":"X.Y"
-  int webuiIdx = json.indexOf("\"webui\"");
-  if (webuiIdx < 0) return "";
+// Builds the tree for version in WEB_STAGE_DIR; false unless every file
+// matches firmware.json
+static bool storage_stageWebUI(const String& version) {
+  storage_lock();
+  storage_rmTree(WEB_STAGE_DIR);
+  bool made = sd.mkdir(WEB_STAGE_DIR);
+  storage_unlock();
+  if (!made) {
+    Serial.println("[SD] cannot create staging dir");
+    return false;
+  }
 
-  int versionIdx = json.indexOf("\"version\"", webuiIdx);
-  if (versionIdx < 0) return "";
+  g_webuiProgress.fetched = 0;
+  for (int i = 0; i < WEB_FILES_COUNT; i++) {
+    char live[40], staged[40], hex[65];
+    uint8_t sha[32];
+    snprintf(live, sizeof(live), "%s/%s", WEB_DIR, WEB_FILES[i]);
+    snprintf(staged, sizeof(staged), "%s/%s", WEB_STAGE_DIR, WEB_FILES[i]);
+    g_webuiProgress.file = i;
+
+    // Unchanged: reuse the copy on the card
+    storage_lock();
+    bool copied = g_webFileSha[i][0] && storage_copyFile(live, staged, sha);
+    storage_unlock();
+    if (copied) {
+      storage_shaHex(sha, hex);
+      if (!strcmp(hex, g_webFileSha[i])) continue;
+    }
 
-  // Find the opening quote of the value
-  int quoteStart = json.indexOf("\"", versionIdx + 9);  // skip "version"
-  if (quoteStart < 0) return "";
+    if (!storage_downloadWebFile(WEB_FILES[i], WEB_STAGE_DIR, sha)) return false;
+    g_webuiProgress.fetched++;
+
+    storage_lock();
+    FsFile f = sd.open(staged, O_RDONLY);
+    size_t actualSize = f ? f.size() : 0;
+    f.close();
+    storage_unlock();
+    storage_shaHex(sha, hex);
+    if (actualSize != g_webFileSizes[i] || (g_webFileSha[i][0] && strcmp(hex, g_webFileSha[i]))) {
+      Serial.printf("[SD] %s mismatch: %u bytes sha256 %.8s, expected %u bytes sha256 %.8s\n",
+                    WEB_FILES[i], (unsigned)actualSize, hex, (unsigned)g_webFileSizes[i], g_webFileSha[i]);
+      return false;
+    }
+    Serial.printf("[SD] %s verified: %u bytes\n", WEB_FILES[i], (unsigned)actualSize);
+  }
 
-  int quoteEnd = json.indexOf("\"", quoteStart + 1);
-  if (quoteEnd < 0) return "";
+  char path[32];
+  snprintf(path, sizeof(path), "%s/.version", WEB_STAGE_DIR);
+  storage_lock();
+  FsFile f = sd.open(path, O_WRITE | O_CREAT | O_TRUNC);
+  bool ok = f && f.print(version) == version.length();
+  f.close();
+  storage_unlock();
+  if (!ok) return false;
 
-  String version = json.substring(quoteStart + 1, quoteEnd);
+  Serial.printf("[SD] WebUI %s staged, %d/%d files downloaded\n", version.c_str(),
+                g_webuiProgress.fetched, WEB_FILES_COUNT);
+  return true;
+}
 
-  // Parse expected file sizes from "files" section
-  for (int i = 0; i < WEB_FILES_COUNT; i++) {
-    g_webFileSizes[i] = storage_parseFileSize(json, WEB_FILES[i]);
-    Serial.printf("[SD] Expected %s: %u bytes\n", WEB_FILES[i], (unsigned)g_webFileSizes[i]);
+// Replaces /web with the staged tree. Both renames happen under the card
+// lock, so a request sees the old UI or the new one, never a mix; a reset
+// in between is finished by storage_webRecover().
+static bool storage_webSwap() {
+  storage_lock();
+  storage_rmTree(WEB_OLD_DIR);
+  bool ok = !sd.exists(WEB_DIR) || sd.rename(WEB_DIR, WEB_OLD_DIR);
+  if (ok && !sd.rename(WEB_STAGE_DIR, WEB_DIR)) {
+    sd.rename(WEB_OLD_DIR, WEB_DIR);  // put the old UI back
+    ok = false;
   }
-
-  return version;
+  storage_rmTree(WEB_OLD_DIR);
+  storage_unlock();
+  return ok;
 }
 
-static void storage_ensureWebUI(bool wifiUp) {
-  if (!g_sdReady) return;
+// force: stage even if the version has not changed (files whose hash
+// matches are kept, so this repairs a damaged UI at little cost)
+static bool storage_syncWebUI(bool wifiUp, bool force) {
+  if (!g_sdReady) return false;
+  g_webuiProgress.state = WEBUI_CHECKING;
+
+  storage_lock();
+  storage_webRecover();
   storage_mkdirs();
 
   bool needsDownload = false;
@@ -527,12 +1360,13 @@ static void storage_ensureWebUI(bool wifiUp) {
       }
     }
   }
+  String localVer = storage_getLocalWebuiVersion();
+  storage_unlock();
 
   // Always check for version update if WiFi is available
   // This handles the case where old webui exists but has no .version file
   String remoteVer = "";
   if (wifiUp) {
-    String localVer = storage_getLocalWebuiVersion();
     remoteVer = storage_getRemoteWebuiVersion(wifiUp);
 
     Serial.printf("[SD] WebUI version: local=%s, remote=%s\n", localVer.c_str(), remoteVer.c_str());
@@ -547,76 +1381,60 @@ static void storage_ensureWebUI(bool wifiUp) {
       } else if (storage_compareVersions(localVer, remoteVer) < 0) {
         Serial.println("[SD] New WebUI version available!");
         needsDownload = true;
+      } else if (force) {
+        Serial.println("[SD] WebUI update requested");
+        needsDownload = true;
       }
     }
   }
 
   if (!needsDownload) {
     Serial.println("[SD] web UI up to date");
-    return;
+    strlcpy(g_webuiVersion, filesExist && localVer != "0.0" ? localVer.c_str() : "", sizeof(g_webuiVersion));
+    g_webuiProgress.state = WEBUI_UP_TO_DATE;
+    return true;
   }
 
-  if (!wifiUp) {
-    Serial.println("[SD] cannot download web UI (no WiFi)");
-    return;
+  if (!wifiUp || remoteVer.length() == 0) {
+    Serial.println("[SD] cannot update web UI (no WiFi or no firmware.json)");
+    g_webuiProgress.state = WEBUI_FAILED;
+    return false;
   }
 
-  Serial.println("[SD] downloading web UI files...");
+  Serial.println("[SD] updating web UI files...");
 
-  // Retry entire download+verify cycle up to 3 times
+  // Retry entire stage+verify cycle up to 3 times
   for (int cycle = 0; cycle < 3; cycle++) {
     if (cycle > 0) {
-      Serial.printf("[SD] WebUI download cycle %d...\n", cycle + 1);
-      delay(3000);  // Wait before retry cycle
-    }
-
-    // Download all web files (with delay between to avoid connection issues)
-    for (int i = 0; i < WEB_FILES_COUNT; i++) {
-      storage_downloadWebFile(WEB_FILES[i], wifiUp);
-      delay(1000);  // Wait between downloads to let connection close properly
-    }
-
-    // Verify all files exist and have exact expected size
-    int successCount = 0;
-    for (int i = 0; i < WEB_FILES_COUNT; i++) {
-      char path[32];
-      snprintf(path, sizeof(path), "/web/%s", WEB_FILES[i]);
-      FsFile f = sd.open(path, O_RDONLY);
-      if (f) {
-        size_t actualSize = f.size();
-        size_t expectedSize = g_webFileSizes[i];
-        f.close();
-
-        if (expectedSize > 0 && actualSize == expectedSize) {
-          successCount++;
-          Serial.printf("[SD] %s verified: %u bytes\n", WEB_FILES[i], (unsigned)actualSize);
-        } else {
-          Serial.printf("[SD] %s size mismatch: got %u, expected %u\n",
-                        WEB_FILES[i], (unsigned)actualSize, (unsigned)expectedSize);
-        }
-      } else {
-        Serial.printf("[SD] %s missing\n", WEB_FILES[i]);
-      }
+      Serial.printf("[SD] WebUI update cycle %d...\n", cycle + 1);
+      if (storage_dlWait(3000)) break;
     }
 
-    // If all files verified, save version and return
-    if (successCount == WEB_FILES_COUNT) {
-      if (remoteVer.length() == 0) {
-        remoteVer = storage_getRemoteWebuiVersion(wifiUp);
-      }
-      if (remoteVer.length() > 0) {
-        storage_saveLocalWebuiVersion(remoteVer);
+    g_webuiProgress.state = WEBUI_STAGING;
+    if (storage_stageWebUI(remoteVer)) {
+      g_webuiProgress.state = WEBUI_SWAPPING;
+      if (storage_webSwap()) {
+        strlcpy(g_webuiVersion, remoteVer.c_str(), sizeof(g_webuiVersion));
         Serial.printf("[SD] WebUI updated to version %s\n", remoteVer.c_str());
+        g_webuiProgress.state = WEBUI_UPDATED;
+        return true;
       }
-      return;  // Success!
     }
-
-    Serial.printf("[SD] WebUI update incomplete: %d/%d files\n", successCount, WEB_FILES_COUNT);
   }
 
-  // All cycles failed - delete version file to force re-download next boot
-  Serial.println("[SD] WebUI update failed after all retries");
-  if (sd.exists(LOCAL_WEBUI_VERSION_FILE)) {
-    sd.remove(LOCAL_WEBUI_VERSION_FILE);
-  }
+  // The live UI was not touched; the next check tries again
+  storage_lock();
+  storage_rmTree(WEB_STAGE_DIR);
+  storage_unlock();
+  Serial.println(storage_dlStopped() ? "[SD] WebUI update stopped" : "[SD] WebUI update failed after all retries");
+  g_webuiProgress.state = WEBUI_FAILED;
+  return false;
+}
+
+// Brings the UI on the card up to date (see storage_syncWebUI). Slow with
+// wifiUp: run it from the uisync task, not a service task.
+static bool storage_ensureWebUI(bool wifiUp, bool force = false) {
+  bool ok = storage_syncWebUI(wifiUp, force);
+  storage_dlEnd();  // close the TLS session if one was opened
+  return ok;
 }
@@ -0,0 +1,84 @@
+#pragma once
+#include <Arduino.h>
+#include <esp_task_wdt.h>
+#include "webcache.h"
+
+// Web UI sync as a background job. A WiFi (re)connect or the "Update WebUI"
+// button starts it; it runs storage_ensureWebUI in its own task so the net
+// task keeps serving, and the card is only locked per step (storage.h).
+// Progress is g_webuiProgress, served by GET /api/webui/status. When it
+// ends the RAM copy of the UI is reloaded if the version changed.
+// uisync_stop (POST /api/webui/cancel) or losing WiFi stops it early.
+
+#define UISYNC_STACK  12288  // TLS handshake, like the net task
+#define UISYNC_PRIO   1
+#define UISYNC_CORE   0
+
+static volatile bool g_uisyncRunning = false;
+static bool g_uisyncForce = false;
+static portMUX_TYPE g_uisyncMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void uisync_task(void*) {
+  esp_task_wdt_add(NULL);
+
+  storage_ensureWebUI(true, g_uisyncForce);
+  storage_dlRelease();
+
+  storage_lock();
+  webcache_load(storage_webuiVersion());
+  storage_unlock();
+
+  esp_task_wdt_delete(NULL);
+  g_uisyncRunning = false;
+  vTaskDelete(NULL);
+}
+
+// Starts a sync; false if one is already running, the download session is
+// busy with a firmware download, or no task could be made
+static bool uisync_start(bool force) {
+  portENTER_CRITICAL(&g_uisyncMux);
+  bool busy = g_uisyncRunning;
+  g_uisyncRunning = true;
+  portEXIT_CRITICAL(&g_uisyncMux);
+  if (busy) return false;
+  if (!storage_dlAcquire()) {
+    g_uisyncRunning = false;
+    return false;
+  }
+
+  g_uisyncForce = force;
+  g_webuiProgress.state = WEBUI_CHECKING;
+  if (xTaskCreatePinnedToCore(uisync_task, "uisync", UISYNC_STACK, nullptr, UISYNC_PRIO, nullptr,
+                              UISYNC_CORE) != pdPASS) {
+    Serial.println("[SD] cannot start web UI sync");
+    g_webuiProgress.state = WEBUI_FAILED;
+    storage_dlRelease();
+    g_uisyncRunning = false;
+    return false;
+  }
+  return true;
+}
+
+// Asks a running sync to stop; its downloads and retry waits end promptly
+// and the live UI is left as it was. False if none is running.
+static bool uisync_stop() {
+  if (!g_uisyncRunning) return false;
+  storage_dlStop();
+  return true;
+}
+
+static bool uisync_running() {
+  return g_uisyncRunning;
+}
+
+// {"running":..,"state":..,"file":..,"fetched":..,"files":..,"bytes":..,"total":..,"version":..}
+static int uisync_statusJson(char* buf, size_t size) {
+  const WebuiProgress& p = g_webuiProgress;
+  uint8_t file = p.file < WEB_FILES_COUNT ? p.file : 0;
+  return snprintf(buf, size,
+    "{\"running\":%s,\"state\":\"%s\",\"file\":\"%s\",\"fetched\":%u,\"files\":%d,"
+    "\"bytes\":%lu,\"total\":%lu,\"version\":\"%s\"}",
+    g_uisyncRunning ? "true" : "false", WEBUI_STATE_NAMES[p.state], WEB_FILES[file],
+    (unsigned)p.fetched, WEB_FILES_COUNT, (unsigned long)g_dlProgress.bytes, (unsigned long)g_dlProgress.total,
+    storage_webuiVersion());
+}
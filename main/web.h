@@ -1,236 +1,777 @@
 #pragma once
-#include <WebServer.h>
-#include <esp_task_wdt.h>
+#include <ESPAsyncWebServer.h>
+#include <memory>
 #include "fs_api.h"
 #include "config.h"
+#include "shared.h"
+#include "metrics.h"
+#include "events.h"
+#include "uisync.h"
 
-static WebServer webServer(80);
+// HTTP runs on ESPAsyncWebServer: requests are parsed and answered in the
+// async_tcp task (core 0, see build_opt.h), many connections at once, each
+// with a bounded send buffer. Handlers must not block: long bodies are
+// produced by filler callbacks as the client drains them, and anything
+// slow runs elsewhere: restarts via web_defer() in the net task, web UI and
+// firmware updates as background jobs (uisync.h, ota.h).
+
+static AsyncWebServer webServer(80);
 
-static Config*    gCfg;
-static Runtime*   gRt;
 static Histories* gHist;
 
+// Status JSON shared by /api/status and the /api/events stream
+static int web_statusJson(char* json, size_t size, const Runtime& rt) {
+  Config c;
+  shared_getConfig(c);
+  return snprintf(json, size,
+    "{\"soil\":%d,\"tempC\":%.1f,\"cpuPct\":%d,\"pumpOn\":%s,\"lockout\":%s,\"mode\":%d,\"onTime\":%lu,"
+    "\"duty\":%u,\"rampPct\":%u,\"adcHz\":%lu,\"adcVar\":%lu}",
+    rt.soilNow,
+    rt.tempC_x10 / 10.0f,
+    metrics_cpuKnown() ? (int)rt.cpuPct : -1,
+    rt.pumpOn ? "true" : "false",
+    rt.lockout ? "true" : "false",
+    (int)c.mode,
+    (unsigned long)(rt.onTimeThisWindowMs / 1000),
+    (unsigned)rt.pumpDuty,
+    (unsigned)rt.rampPct,
+    (unsigned long)rt.adcSampleHz,
+    (unsigned long)rt.adcNoiseVar
+  );
+}
+
 // GET /api/status - real-time sensor data (matches webui expectations)
-static void handleStatus() {
+static void handleStatus(AsyncWebServerRequest* req) {
+  Runtime rt;
+  shared_getRuntime(rt);
+
   char json[256];
-  snprintf(json, sizeof(json),
-    "{\"soil\":%d,\"tempC\":%.1f,\"cpuPct\":%u,\"pumpOn\":%s,\"lockout\":%s,\"mode\":%d,\"onTime\":%lu}",
-    gRt->soilNow,
-    gRt->tempC_x10 / 10.0f,
-    gRt->cpuPct,
-    gRt->pumpOn ? "true" : "false",
-    gRt->lockout ? "true" : "false",
-    (int)gCfg->mode,
-    (unsigned long)(gRt->onTimeThisWindowMs / 1000)
-  );
-  webServer.send(200, "application/json", json);
+  web_statusJson(json, sizeof(json), rt);
+  req->send(200, "application/json", json);
+}
+
+// ---- live status push
+// A status frame goes out when something visible changes (pump, lockout,
+// mode at once; readings past a threshold), at most every
+// EVT_MIN_INTERVAL_MS, and at least every EVT_HEARTBEAT_MS.
+#define EVT_MIN_INTERVAL_MS  250
+#define EVT_HEARTBEAT_MS     10000
+#define EVT_SOIL_DELTA       5
+#define EVT_TEMP_DELTA_X10   5    // 0.5 C
+#define EVT_CPU_DELTA        5
+#define EVT_RAMP_DELTA       25
+
+static bool web_statusChanged(const Runtime& a, const Runtime& b) {
+  return a.pumpOn != b.pumpOn ||
+         a.lockout != b.lockout ||
+         abs(a.soilNow - b.soilNow) >= EVT_SOIL_DELTA ||
+         abs(a.tempC_x10 - b.tempC_x10) >= EVT_TEMP_DELTA_X10 ||
+         abs((int)a.cpuPct - (int)b.cpuPct) >= EVT_CPU_DELTA ||
+         abs((int)a.rampPct - (int)b.rampPct) >= EVT_RAMP_DELTA;
+}
+
+static void web_pushStatus() {
+  static Runtime lastRt;
+  static int lastMode = -1;
+  static uint32_t lastMs = 0;
+
+  if (events_clientCount() == 0) return;
+
+  uint32_t now = millis();
+  if (!g_evtNewClient && now - lastMs < EVT_MIN_INTERVAL_MS) return;
+
+  Runtime rt;
+  shared_getRuntime(rt);
+  Config c;
+  shared_getConfig(c);
+  bool due = g_evtNewClient || now - lastMs >= EVT_HEARTBEAT_MS ||
+             (int)c.mode != lastMode || web_statusChanged(rt, lastRt);
+  if (!due) return;
+
+  char json[256];
+  web_statusJson(json, sizeof(json), rt);
+  events_broadcast("status", json);
+
+  lastRt = rt;
+  lastMode = (int)c.mode;
+  lastMs = now;
+  g_evtNewClient = false;
+}
+
+// GET /api/metrics - CPU load, per-subsystem timing, control period histogram
+// ?reset=1 clears the counters after reporting them
+static void handleMetrics(AsyncWebServerRequest* req) {
+  char json[768];
+  metrics_toJson(json, sizeof(json));
+  if (req->hasArg("reset") && req->arg("reset") == "1") metrics_reset();
+  req->send(200, "application/json", json);
 }
 
 // GET /api/config/get - get full config
-static void handleGetConfig() {
+static void handleGetConfig(AsyncWebServerRequest* req) {
+  Config c;
+  shared_getConfig(c);
   char json[512];
   snprintf(json, sizeof(json),
-    "{\"dryOn\":%d,\"wetOff\":%d,\"pumpPwm\":%d,\"softRamp\":%s,"
+    "{\"dryOn\":%d,\"wetOff\":%d,\"pumpPwm\":%d,\"softRamp\":%s,\"rampMs\":%lu,"
     "\"minOnMs\":%lu,\"minOffMs\":%lu,\"limitWindowSec\":%lu,"
-    "\"maxOnSecInWindow\":%lu,\"logPeriodMs\":%lu,\"mode\":%d}",
-    gCfg->dryOn,
-    gCfg->wetOff,
-    gCfg->pumpPwm,
-    gCfg->softRamp ? "true" : "false",
-    (unsigned long)gCfg->minOnMs,
-    (unsigned long)gCfg->minOffMs,
-    (unsigned long)gCfg->limitWindowSec,
-    (unsigned long)gCfg->maxOnSecInWindow,
-    (unsigned long)gCfg->logPeriodMs,
-    (int)gCfg->mode
+    "\"maxOnSecInWindow\":%lu,\"logPeriodMs\":%lu,\"mode\":%d,"
+    "\"adcMedianN\":%d,\"adcIirPct\":%d}",
+    c.dryOn,
+    c.wetOff,
+    c.pumpPwm,
+    c.softRamp ? "true" : "false",
+    (unsigned long)c.rampMs,
+    (unsigned long)c.minOnMs,
+    (unsigned long)c.minOffMs,
+    (unsigned long)c.limitWindowSec,
+    (unsigned long)c.maxOnSecInWindow,
+    (unsigned long)c.logPeriodMs,
+    (int)c.mode,
+    c.adcMedianN,
+    c.adcIirPct
   );
-  webServer.send(200, "application/json", json);
+  req->send(200, "application/json", json);
 }
 
 // POST /api/config/set - update config
-static void handleSetConfig() {
+// Edits the web side's config; the control task picks it up at the start
+// of its next cycle.
+static void handleSetConfig(AsyncWebServerRequest* req) {
+  Config c;
+  shared_getConfig(c);
   bool changed = false;
 
-  if (webServer.hasArg("dryOn")) {
-    gCfg->dryOn = webServer.arg("dryOn").toInt();
+  if (req->hasArg("dryOn")) {
+    c.dryOn = req->arg("dryOn").toInt();
+    changed = true;
+  }
+  if (req->hasArg("wetOff")) {
+    c.wetOff = req->arg("wetOff").toInt();
+    changed = true;
+  }
+  if (req->hasArg("pumpPwm")) {
+    c.pumpPwm = req->arg("pumpPwm").toInt();
+    changed = true;
+  }
+  if (req->hasArg("mode")) {
+    c.mode = (PumpMode)req->arg("mode").toInt();
     changed = true;
   }
-  if (webServer.hasArg("wetOff")) {
-    gCfg->wetOff = webServer.arg("wetOff").toInt();
+  if (req->hasArg("softRamp")) {
+    c.softRamp = req->arg("softRamp").toInt() != 0;
     changed = true;
   }
-  if (webServer.hasArg("pumpPwm")) {
-    gCfg->pumpPwm = webServer.arg("pumpPwm").toInt();
+  if (req->hasArg("rampMs")) {
+    c.rampMs = req->arg("rampMs").toInt();
     changed = true;
   }
-  if (webServer.hasArg("mode")) {
-    gCfg->mode = (PumpMode)webServer.arg("mode").toInt();
+  if (req->hasArg("minOnMs")) {
+    c.minOnMs = req->arg("minOnMs").toInt();
     changed = true;
   }
-  if (webServer.hasArg("softRamp")) {
-    gCfg->softRamp = webServer.arg("softRamp").toInt() != 0;
+  if (req->hasArg("minOffMs")) {
+    c.minOffMs = req->arg("minOffMs").toInt();
     changed = true;
   }
-  if (webServer.hasArg("minOnMs")) {
-    gCfg->minOnMs = webServer.arg("minOnMs").toInt();
+  if (req->hasArg("maxOnSecInWindow")) {
+    c.maxOnSecInWindow = req->arg("maxOnSecInWindow").toInt();
     changed = true;
   }
-  if (webServer.hasArg("minOffMs")) {
-    gCfg->minOffMs = webServer.arg("minOffMs").toInt();
+  if (req->hasArg("limitWindowSec")) {
+    c.limitWindowSec = req->arg("limitWindowSec").toInt();
     changed = true;
   }
-  if (webServer.hasArg("maxOnSecInWindow")) {
-    gCfg->maxOnSecInWindow = webServer.arg("maxOnSecInWindow").toInt();
+  if (req->hasArg("adcMedianN")) {
+    c.adcMedianN = req->arg("adcMedianN").toInt();
     changed = true;
   }
-  if (webServer.hasArg("limitWindowSec")) {
-    gCfg->limitWindowSec = webServer.arg("limitWindowSec").toInt();
+  if (req->hasArg("adcIirPct")) {
+    c.adcIirPct = req->arg("adcIirPct").toInt();
     changed = true;
   }
 
   if (changed) {
-    storage_validateConfig(*gCfg);
-    storage_saveConfig(*gCfg);
+    storage_validateConfig(c);
+    storage_saveConfig(c);
+    shared_postConfig(c);
     Serial.println("[WEB] Config updated");
   }
 
-  webServer.send(200, "application/json", "{\"ok\":true}");
+  req->send(200, "application/json", "{\"ok\":true}");
 }
 
-// POST /api/restart - restart ESP
-static void handleRestart() {
-  webServer.send(200, "application/json", "{\"ok\":true}");
-  webServer.client().flush();
-  delay(100);
-  ESP.restart();
+// ---- slow actions, run by web_loop() in the net task
+enum WebAction : uint8_t {
+  WEB_ACT_NONE = 0,
+  WEB_ACT_RESTART
+};
+
+#define WEB_ACTION_DELAY_MS  300   // let the reply go out first
+
+static volatile WebAction g_webAction = WEB_ACT_NONE;
+static volatile uint32_t g_webActionMs = 0;
+
+static void web_defer(WebAction a) {
+  g_webActionMs = millis();
+  g_webAction = a;
 }
 
-// GET /api/history - sensor history
-static void handleHistory() {
-  // Reset watchdog before long operation
-  esp_task_wdt_reset();
+// POST /api/restart - restart ESP
+static void handleRestart(AsyncWebServerRequest* req) {
+  req->send(200, "application/json", "{\"ok\":true}");
+  web_defer(WEB_ACT_RESTART);
+}
 
-  int count = gHist->filled ? HIST_LEN : gHist->idx;
+// ---- streamed responses
+// The body is cut into tokens (next() fills pend); the filler copies as much
+// as the connection can take and keeps the rest for the next call. Each call
+// holds the card, since tokens may read the history rings or log files.
+struct WebStream {
+  char pend[192];
+  uint16_t len = 0;
+  uint16_t pos = 0;
+
+  virtual ~WebStream() {}
+  virtual bool next() = 0;  // false when the body is complete
+};
+
+static size_t web_streamFill(WebStream& s, uint8_t* buf, size_t maxLen) {
+  if (!storage_lock(pdMS_TO_TICKS(WEB_LOCK_WAIT_MS))) return RESPONSE_TRY_AGAIN;
+  uint32_t t0 = micros();
+
+  size_t n = 0;
+  while (n < maxLen) {
+    if (s.pos == s.len) {
+      s.pos = s.len = 0;
+      if (!s.next()) break;
+      if (s.len == 0) continue;
+    }
+    size_t k = min(maxLen - n, (size_t)(s.len - s.pos));
+    memcpy(buf + n, s.pend + s.pos, k);
+    s.pos += k;
+    n += k;
+  }
 
-  // Build JSON in a buffer - more reliable than streaming
-  // Estimate: 240 items * 3 arrays * ~8 chars each = ~6KB max
-  String json;
-  json.reserve(8192);
+  metrics_record(MET_WEB, micros() - t0);
+  storage_unlock();
+  return n;
+}
 
-  json = "{\"len\":";
-  json += count;
-  json += ",\"idx\":";
-  json += gHist->idx;
-  json += ",\"soil\":[";
+// length 0 = chunked
+static AsyncWebServerResponse* web_streamResponse(AsyncWebServerRequest* req, const char* contentType,
+                                                  std::shared_ptr<WebStream> s, size_t length) {
+  auto fill = [s](uint8_t* buf, size_t maxLen, size_t) -> size_t {
+    return web_streamFill(*s, buf, maxLen);
+  };
+  return length ? req->beginResponse(contentType, length, fill)
+                : req->beginChunkedResponse(contentType, fill);
+}
 
-  for (int i = 0; i < count; i++) {
-    if (i > 0) json += ",";
-    json += gHist->soil[i];
+// ---- /api/history and /api/history.bin
+//
+// Both pick the finest tier that covers ?window=SEC: raw samples
+// (logPeriodMs), 1 min or 1 h rollups; no window = raw. Entries are oldest
+// first and can be narrowed with
+//   since=T   entries from time T on: Unix seconds once NTP has synced,
+//             seconds of uptime before that. Entry times are derived from the
+//             tier period, counting back from the newest entry.
+//   after=S   entries with a sequence number above S (delta polling); takes
+//             precedence over since
+//   step=N    every Nth entry, always including the newest
+// Each reply carries t (time of the newest entry, same clock as since), seq
+// (sequence number of the newest entry) and boot (changes with every boot
+// when an SD card is present). Polling with after=seq returns only what is
+// new; a different boot, or seq below the one asked for, means start over.
+// temp is in 0.1 C; rollups add soilMin/soilMax and pump (% of samples with
+// the pump on). Produced a piece at a time as the client takes it, straight
+// into the server's send buffer.
+
+enum HistTierId : uint8_t {
+  HIST_RAW    = 0,
+  HIST_MINUTE = 1,
+  HIST_HOUR   = 2
+};
+
+static const char* const HIST_TIER_NAMES[] = { "raw", "minute", "hour" };
+
+// One field of a tier: JSON name, bytes per entry in history.bin, value at a slot
+struct HistField {
+  const char* name;
+  uint8_t bytes;
+  int (*get)(const Histories& h, uint16_t slot);
+};
+
+static const HistField HIST_RAW_FIELDS[] = {
+  { "soil", 2, [](const Histories& h, uint16_t i) -> int { return h.soil[i]; } },
+  { "temp", 2, [](const Histories& h, uint16_t i) -> int { return h.tempC_x10[i]; } },
+  { "cpu",  1, [](const Histories& h, uint16_t i) -> int { return h.cpuPct[i]; } },
+};
+
+static const HistField HIST_MIN_FIELDS[] = {
+  { "soil",    2, [](const Histories& h, uint16_t i) -> int { return h.minute.buf[i].soilMean; } },
+  { "soilMin", 2, [](const Histories& h, uint16_t i) -> int { return h.minute.buf[i].soilMin; } },
+  { "soilMax", 2, [](const Histories& h, uint16_t i) -> int { return h.minute.buf[i].soilMax; } },
+  { "temp",    2, [](const Histories& h, uint16_t i) -> int { return h.minute.buf[i].tempC_x10; } },
+  { "cpu",     1, [](const Histories& h, uint16_t i) -> int { return h.minute.buf[i].cpuPct; } },
+  { "pump",    1, [](const Histories& h, uint16_t i) -> int { return h.minute.buf[i].pumpPct; } },
+};
+
+static const HistField HIST_HOUR_FIELDS[] = {
+  { "soil",    2, [](const Histories& h, uint16_t i) -> int { return h.hour.buf[i].soilMean; } },
+  { "soilMin", 2, [](const Histories& h, uint16_t i) -> int { return h.hour.buf[i].soilMin; } },
+  { "soilMax", 2, [](const Histories& h, uint16_t i) -> int { return h.hour.buf[i].soilMax; } },
+  { "temp",    2, [](const Histories& h, uint16_t i) -> int { return h.hour.buf[i].tempC_x10; } },
+  { "cpu",     1, [](const Histories& h, uint16_t i) -> int { return h.hour.buf[i].cpuPct; } },
+  { "pump",    1, [](const Histories& h, uint16_t i) -> int { return h.hour.buf[i].pumpPct; } },
+};
+
+// Where a tier's ring stands right now
+struct HistRing {
+  uint16_t idx;
+  bool     filled;
+  uint16_t size;
+  uint32_t periodMs;
+  uint32_t lastMs;
+  uint32_t seq;
+  const HistField* fields;
+  uint8_t  nFields;
+};
+
+static HistRing web_ring(HistTierId tier) {
+  const Histories& h = *gHist;
+  Config c;
+  shared_getConfig(c);
+  switch (tier) {
+    case HIST_MINUTE:
+      return { h.minute.idx, h.minute.filled, HIST_MIN_LEN, HIST_MIN_PERIOD_MS, h.minute.lastMs,
+               h.minute.seq, HIST_MIN_FIELDS, 6 };
+    case HIST_HOUR:
+      return { h.hour.idx, h.hour.filled, HIST_HOUR_LEN, HIST_HOUR_PERIOD_MS, h.hour.lastMs,
+               h.hour.seq, HIST_HOUR_FIELDS, 6 };
+    default:
+      return { h.idx, h.filled, HIST_LEN, c.logPeriodMs, h.lastMs, h.seq, HIST_RAW_FIELDS, 3 };
   }
+}
+
+static uint32_t web_argU32(AsyncWebServerRequest* req, const char* name, uint32_t def) {
+  return req->hasArg(name) ? strtoul(req->arg(name).c_str(), nullptr, 10) : def;
+}
+
+// A query resolved against the ring at request time. Entries are then
+// addressed by sequence number, so samples added while the reply is being
+// sent do not shift it.
+struct HistSel {
+  HistTierId tier;
+  uint32_t firstSeq;  // first selected entry
+  uint32_t step;
+  uint32_t len;       // entries selected
+  uint32_t periodMs;  // between selected entries
+  uint32_t t;         // time of the newest entry
+  uint32_t seq;       // newest entry
+};
+
+static HistSel web_historySelect(AsyncWebServerRequest* req) {
+  HistSel sel{};
+  uint32_t windowSec = web_argU32(req, "window", 0);
+  Config c;
+  shared_getConfig(c);
+  uint32_t rawSpanSec = (uint32_t)((uint64_t)HIST_LEN * c.logPeriodMs / 1000);
+  if (windowSec == 0 || windowSec <= rawSpanSec) sel.tier = HIST_RAW;
+  else if (windowSec <= HIST_MIN_LEN * (HIST_MIN_PERIOD_MS / 1000)) sel.tier = HIST_MINUTE;
+  else sel.tier = HIST_HOUR;
+
+  uint32_t step = constrain(web_argU32(req, "step", 1), 1UL, 65535UL);
+  uint64_t sinceMs = (uint64_t)web_argU32(req, "since", 0) * 1000;
+  uint32_t epoch = storage_epochNow();
+  uint64_t clockNowMs = epoch ? (uint64_t)epoch * 1000 : millis();
+
+  HistRing ring = web_ring(sel.tier);
+  uint16_t count = history_count(ring.idx, ring.filled, ring.size);
+  uint64_t newestMs = clockNowMs - (uint32_t)(millis() - ring.lastMs);
+  HistRange r = req->hasArg("after")
+    ? history_rangeAfter(count, step, ring.seq, web_argU32(req, "after", 0))
+    : history_range(count, step, ring.periodMs, newestMs, sinceMs);
+
+  sel.step = r.step;
+  sel.len = r.first < r.count ? (r.count - 1 - r.first) / r.step + 1 : 0;
+  sel.firstSeq = ring.seq - (count - 1 - r.first);
+  sel.periodMs = ring.periodMs * r.step;
+  sel.t = (uint32_t)(newestMs / 1000);
+  sel.seq = ring.seq;
+  return sel;
+}
+
+// Value of field f for selected entry j, from the ring as it is now
+static int web_historyValue(const HistSel& sel, const HistRing& ring, uint8_t f, uint32_t j) {
+  uint32_t s = sel.firstSeq + j * sel.step;
+  uint32_t oldest = ring.seq - history_count(ring.idx, ring.filled, ring.size) + 1;
+  if (s < oldest) s = oldest;  // overwritten while we were sending
+  return ring.fields[f].get(*gHist, history_slotOfSeq(ring.idx, ring.size, ring.seq, s));
+}
 
-  json += "],\"temp\":[";
-  for (int i = 0; i < count; i++) {
-    if (i > 0) json += ",";
-    json += String(gHist->tempC_x10[i] / 10.0f, 1);
+// ---- JSON
+struct HistJsonStream : WebStream {
+  HistSel sel;
+  uint8_t field = 0;
+  uint32_t j = 0;
+  uint8_t phase = 0;  // 0 head, 1 field open, 2 values, 3 field close, 4 end, 5 done
+
+  bool next() override {
+    HistRing ring = web_ring(sel.tier);
+    switch (phase) {
+      case 0:
+        len = snprintf(pend, sizeof(pend),
+          "{\"tier\":\"%s\",\"period\":%lu,\"len\":%lu,\"t\":%lu,\"seq\":%lu,\"boot\":%lu",
+          HIST_TIER_NAMES[sel.tier], (unsigned long)sel.periodMs, (unsigned long)sel.len,
+          (unsigned long)sel.t, (unsigned long)sel.seq, (unsigned long)storage_bootId());
+        phase = 1;
+        return true;
+      case 1:
+        if (field >= ring.nFields) {
+          phase = 4;
+          return true;
+        }
+        len = snprintf(pend, sizeof(pend), ",\"%s\":[", ring.fields[field].name);
+        j = 0;
+        phase = 2;
+        return true;
+      case 2:
+        if (j >= sel.len) {
+          phase = 3;
+          return true;
+        }
+        // a run of values per token
+        while (j < sel.len && len < sizeof(pend) - 8) {
+          len += snprintf(pend + len, sizeof(pend) - len, j ? ",%d" : "%d",
+                          web_historyValue(sel, ring, field, j));
+          j++;
+        }
+        return true;
+      case 3:
+        len = snprintf(pend, sizeof(pend), "]");
+        field++;
+        phase = 1;
+        return true;
+      case 4:
+        len = snprintf(pend, sizeof(pend), "}");
+        phase = 5;
+        return true;
+    }
+    return false;
   }
+};
 
-  json += "],\"cpu\":[";
-  for (int i = 0; i < count; i++) {
-    if (i > 0) json += ",";
-    json += gHist->cpuPct[i];
+// GET /api/history?window=SEC&since=T&after=S&step=N
+static void handleHistory(AsyncWebServerRequest* req) {
+  auto s = std::make_shared<HistJsonStream>();
+  s->sel = web_historySelect(req);
+  req->send(web_streamResponse(req, "application/json", s, 0));
+}
+
+// ---- binary
+#define HIST_BIN_MAGIC    0x54534948UL  // "HIST"
+#define HIST_BIN_VERSION  2
+
+struct HistBinHeader {
+  uint32_t magic;
+  uint8_t  version;
+  uint8_t  tier;       // HistTierId
+  uint16_t count;      // entries per array
+  uint16_t size;       // ring capacity
+  uint16_t step;
+  uint32_t periodMs;   // between entries as sent (tier period * step)
+  uint32_t t;
+  uint32_t seq;
+  uint32_t boot;
+  uint16_t tempScale;  // tempC = temp / tempScale
+  uint16_t rsv;
+};
+
+static_assert(sizeof(HistBinHeader) == 32, "HistBinHeader must stay 32 bytes");
+
+struct HistBinStream : WebStream {
+  HistSel sel;
+  uint8_t field = 0;
+  uint32_t j = 0;
+  bool head = true;
+
+  bool next() override {
+    if (head) {
+      HistBinHeader hb{};
+      hb.magic = HIST_BIN_MAGIC;
+      hb.version = HIST_BIN_VERSION;
+      hb.tier = sel.tier;
+      hb.count = (uint16_t)sel.len;
+      hb.size = web_ring(sel.tier).size;
+      hb.step = (uint16_t)sel.step;
+      hb.periodMs = sel.periodMs;
+      hb.t = sel.t;
+      hb.seq = sel.seq;
+      hb.boot = storage_bootId();
+      hb.tempScale = 10;
+      memcpy(pend, &hb, sizeof(hb));
+      len = sizeof(hb);
+      head = false;
+      return true;
+    }
+
+    HistRing ring = web_ring(sel.tier);
+    while (field < ring.nFields && j >= sel.len) {
+      field++;
+      j = 0;
+    }
+    if (field >= ring.nFields) return false;
+
+    uint8_t bytes = ring.fields[field].bytes;
+    while (j < sel.len && len + bytes <= sizeof(pend)) {
+      int v = web_historyValue(sel, ring, field, j++);
+      if (bytes == 2) {
+        int16_t x = (int16_t)v;
+        memcpy(pend + len, &x, 2);
+      } else {
+        pend[len] = (char)(uint8_t)v;
+      }
+      len += bytes;
+    }
+    return true;
   }
+};
+
+// GET /api/history.bin - same query as /api/history. Reply: HistBinHeader,
+// then each field as a little-endian array of count entries, oldest first:
+//   raw:     int16 soil, int16 temp, uint8 cpu
+//   rollups: int16 soil (mean), soilMin, soilMax, temp, uint8 cpu, pump
+static void handleHistoryBin(AsyncWebServerRequest* req) {
+  auto s = std::make_shared<HistBinStream>();
+  s->sel = web_historySelect(req);
+
+  HistRing ring = web_ring(s->sel.tier);
+  size_t entryBytes = 0;
+  for (uint8_t f = 0; f < ring.nFields; f++) entryBytes += ring.fields[f].bytes;
+
+  req->send(web_streamResponse(req, "application/octet-stream", s,
+                               sizeof(HistBinHeader) + s->sel.len * entryBytes));
+}
 
-  json += "]}";
+// ---- log
+struct LogStream : WebStream {
+  LogCursor cur;
+  bool bin = false;
+  bool header = true;
+  LogRecord block[LOGBUF_SECTOR / sizeof(LogRecord)];
+  uint32_t n = 0;
+  uint32_t have = 0;
+
+  ~LogStream() override { storage_logCursorEnd(cur); }
+
+  bool next() override {
+    if (header) {
+      header = false;
+      if (!bin) len = strlcpy(pend, LOGFMT_CSV_HEADER, sizeof(pend));
+      return true;
+    }
+    if (n == have) {
+      have = storage_logCursorRead(cur, block, sizeof(block) / sizeof(block[0]));
+      n = 0;
+      if (have == 0) return false;
+    }
+    const LogRecord& r = block[n++];
+    if (bin) {
+      memcpy(pend, &r, sizeof(r));
+      len = sizeof(r);
+    } else {
+      len = logfmt_toCsv(r, pend, sizeof(pend));
+    }
+    return true;
+  }
+};
+
+// GET /api/log?from=T1&to=T2&format=csv|bin - logged records between two Unix
+// times (inclusive), streamed chunked. CSV is converted on the fly from the
+// binary segments; bin is the raw 16-byte LogRecords. No range = everything.
+static void handleLog(AsyncWebServerRequest* req) {
+  auto s = std::make_shared<LogStream>();
+  s->bin = req->arg("format") == "bin";
+  storage_logCursorBegin(s->cur, web_argU32(req, "from", 0), web_argU32(req, "to", 0xFFFFFFFFUL));
+
+  AsyncWebServerResponse* res = web_streamResponse(req, s->bin ? "application/octet-stream" : "text/csv", s, 0);
+  if (!s->bin) res->addHeader("Content-Disposition", "attachment; filename=\"log.csv\"");
+  req->send(res);
+}
 
-  webServer.send(200, "application/json", json);
+// POST /api/webui/update - sync the web UI with GitHub in the background;
+// files whose hash changed are fetched. Progress: GET /api/webui/status
+static void handleWebuiUpdate(AsyncWebServerRequest* req) {
+  if (!uisync_start(true)) {
+    req->send(409, "application/json", "{\"ok\":false,\"msg\":\"Update already running\"}");
+    return;
+  }
+  req->send(202, "application/json", "{\"ok\":true,\"msg\":\"Web UI update started\"}");
 }
 
-// POST /api/webui/update - force re-download webui from GitHub
-static void handleWebuiUpdate() {
-  // Delete version file to force re-download
-  if (sd.exists("/web/.version")) sd.remove("/web/.version");
+// GET /api/webui/status
+static void handleWebuiStatus(AsyncWebServerRequest* req) {
+  char json[256];
+  uisync_statusJson(json, sizeof(json));
+  req->send(200, "application/json", json);
+}
 
-  webServer.send(200, "application/json", "{\"ok\":true,\"msg\":\"Restarting to update...\"}");
-  webServer.client().flush();
-  delay(100);
-  ESP.restart();
+// POST /api/webui/cancel - stop a running web UI sync
+static void handleWebuiCancel(AsyncWebServerRequest* req) {
+  if (!uisync_stop()) {
+    req->send(409, "application/json", "{\"ok\":false,\"msg\":\"No update running\"}");
+    return;
+  }
+  req->send(202, "application/json", "{\"ok\":true,\"msg\":\"Web UI update stopping\"}");
 }
 
 // POST /api/firmware/update - check and apply firmware update from GitHub
-static void handleFirmwareUpdate() {
-  webServer.send(200, "application/json", "{\"ok\":true,\"msg\":\"Checking for firmware update...\"}");
-  webServer.client().flush();
-  delay(100);
-  ota_checkForUpdate();
-}
-
-// Serve static files from SD card
-static void handleStaticFile(const char* path, const char* contentType) {
-  FsFile f = sd.open(path, O_RDONLY);
-  if (!f) {
-    webServer.send(404, "text/plain", "File not found");
+static void handleFirmwareUpdate(AsyncWebServerRequest* req) {
+  if (!ota_startCheck()) {
+    req->send(409, "application/json", "{\"ok\":false,\"msg\":\"Update or download already running\"}");
+    return;
+  }
+  req->send(202, "application/json", "{\"ok\":true,\"msg\":\"Checking for firmware update...\"}");
+}
+
+// Serve the web UI. Files come from the RAM cache (webcache.h) when it
+// holds them, else from the card, where the UI is stored gzipped (path +
+// ".gz") and the plain file is the fallback for cards from before the
+// switch. Gzipped files are sent as-is with Content-Encoding. The ETag is
+// the webui version plus the encoding, so after the first visit a reload is
+// a conditional GET that ends in 304.
+static bool web_notModified(AsyncWebServerRequest* req, bool gzip, char* etag, size_t size) {
+  etag[0] = 0;
+  if (!storage_webuiVersion()[0]) return false;
+  snprintf(etag, size, "\"%s%s\"", storage_webuiVersion(), gzip ? "-gz" : "");
+  if (req->header("If-None-Match") != etag) return false;
+
+  AsyncWebServerResponse* res = req->beginResponse(304);
+  res->addHeader("ETag", etag);
+  res->addHeader("Cache-Control", "no-cache");
+  req->send(res);
+  return true;
+}
+
+static void web_sendStatic(AsyncWebServerRequest* req, AsyncWebServerResponse* res, bool gzip, const char* etag) {
+  if (gzip) res->addHeader("Content-Encoding", "gzip");
+  if (etag[0]) res->addHeader("ETag", etag);
+  res->addHeader("Cache-Control", "no-cache");  // always revalidate, 304 when unchanged
+  res->addHeader("Vary", "Accept-Encoding");
+  req->send(res);
+}
+
+static void handleStaticFile(AsyncWebServerRequest* req, const char* path, const char* contentType) {
+  bool acceptGzip = req->header("Accept-Encoding").indexOf("gzip") >= 0;
+  char etag[32];
+
+  std::shared_ptr<const WebAsset> a = webcache_get(path);
+  if (a && (acceptGzip || !a->gzip)) {
+    metrics_recordCache(true);
+    if (web_notModified(req, a->gzip, etag, sizeof(etag))) return;
+    // Copied from the cached buffer straight into the connection's send
+    // buffer; the response keeps the asset alive until it is done
+    AsyncWebServerResponse* res = req->beginResponse(contentType, a->len,
+      [a](uint8_t* buf, size_t maxLen, size_t index) -> size_t {
+        size_t n = min(maxLen, a->len - index);
+        memcpy(buf, a->data + index, n);
+        return n;
+      });
+    web_sendStatic(req, res, a->gzip, etag);
+    return;
+  }
+  metrics_recordCache(false);
+
+  if (!storage_lock(pdMS_TO_TICKS(WEB_LOCK_WAIT_MS))) {
+    req->send(503, "text/plain", "SD busy");
     return;
   }
+  uint32_t t0 = micros();
 
-  webServer.setContentLength(f.size());
-  webServer.send(200, contentType, "");
+  char gzPath[40];
+  snprintf(gzPath, sizeof(gzPath), "%s.gz", path);
+  bool gzip = sd.exists(gzPath) && (acceptGzip || !sd.exists(path));
 
-  uint8_t buf[1024];
-  while (f.available()) {
-    size_t n = f.read(buf, sizeof(buf));
-    if (n == 0) break;
-    webServer.client().write(buf, n);
-    delay(0);
+  if (!web_notModified(req, gzip, etag, sizeof(etag))) {
+    AsyncWebServerResponse* res = fs_fileResponse(req, gzip ? gzPath : path, contentType);
+    if (res) web_sendStatic(req, res, gzip, etag);
+    else req->send(404, "text/plain", "File not found");
   }
 
-  f.close();
+  metrics_record(MET_WEB, micros() - t0);
+  storage_unlock();
 }
 
-static void handleRoot() {
-  handleStaticFile("/web/index.html", "text/html");
+static void handleRoot(AsyncWebServerRequest* req) {
+  handleStaticFile(req, "/web/index.html", "text/html");
 }
 
-static void handleAppJs() {
-  handleStaticFile("/web/app.js", "application/javascript");
+static void handleAppJs(AsyncWebServerRequest* req) {
+  handleStaticFile(req, "/web/app.js", "application/javascript");
 }
 
-static void handleStyleCss() {
-  handleStaticFile("/web/style.css", "text/css");
+static void handleStyleCss(AsyncWebServerRequest* req) {
+  handleStaticFile(req, "/web/style.css", "text/css");
 }
 
-static void web_begin(Config* cfg, Runtime* rt, Histories* hist) {
-  gCfg  = cfg;
-  gRt   = rt;
+static void web_begin(Histories* hist) {
   gHist = hist;
 
-  // Static files
-  webServer.on("/", HTTP_GET, handleRoot);
-  webServer.on("/app.js", HTTP_GET, handleAppJs);
-  webServer.on("/style.css", HTTP_GET, handleStyleCss);
-
-  // API endpoints
-  webServer.on("/api/status", HTTP_GET, handleStatus);
-  webServer.on("/api/config/get", HTTP_GET, handleGetConfig);
-  webServer.on("/api/config/set", HTTP_POST, handleSetConfig);
-  webServer.on("/api/history", HTTP_GET, handleHistory);
-  webServer.on("/api/restart", HTTP_POST, handleRestart);
-  webServer.on("/api/webui/update", HTTP_POST, handleWebuiUpdate);
-  webServer.on("/api/webui/update", HTTP_GET, handleWebuiUpdate);  // Also allow GET for easy browser trigger
-  webServer.on("/api/firmware/update", HTTP_POST, handleFirmwareUpdate);
-  webServer.on("/api/firmware/update", HTTP_GET, handleFirmwareUpdate);  // Also allow GET for easy browser trigger
-
-  // File browser
-  fs_register(webServer);
+  // Routes survive stop/begin across WiFi reconnects; add them once
+  static bool routed = false;
+  if (!routed) {
+    routed = true;
+
+    // Static files (RAM cache first; the card is locked only on a miss)
+    webServer.on("/", HTTP_GET, handleRoot);
+    webServer.on("/app.js", HTTP_GET, handleAppJs);
+    webServer.on("/style.css", HTTP_GET, handleStyleCss);
+
+    // API endpoints
+    webServer.on("/api/status", HTTP_GET, handleStatus);
+    webServer.on("/api/metrics", HTTP_GET, handleMetrics);
+    webServer.on("/api/config/get", HTTP_GET, handleGetConfig);
+    webServer.on("/api/config/set", HTTP_POST, web_locked(handleSetConfig));
+    webServer.on("/api/history", HTTP_GET, web_locked(handleHistory));
+    webServer.on("/api/history.bin", HTTP_GET, web_locked(handleHistoryBin));
+    webServer.on("/api/log", HTTP_GET, web_locked(handleLog));
+    webServer.on("/api/log.csv", HTTP_GET, web_locked(handleLog));
+    webServer.on("/api/restart", HTTP_POST, handleRestart);
+    webServer.on("/api/webui/update", HTTP_POST, handleWebuiUpdate);
+    webServer.on("/api/webui/update", HTTP_GET, handleWebuiUpdate);  // Also allow GET for easy browser trigger
+    webServer.on("/api/webui/status", HTTP_GET, handleWebuiStatus);
+    webServer.on("/api/webui/cancel", HTTP_POST, handleWebuiCancel);
+    webServer.on("/api/firmware/update", HTTP_POST, handleFirmwareUpdate);
+    webServer.on("/api/firmware/update", HTTP_GET, handleFirmwareUpdate);  // Also allow GET for easy browser trigger
+
+    // Live status
+    events_begin(webServer);
+
+    // File browser
+    fs_register(webServer);
+  }
 
   webServer.begin();
   Serial.println("[WEB] server started");
 }
 
+// Net task: status push and deferred actions; requests are served elsewhere
 static void web_loop() {
-  webServer.handleClient();
+  web_pushStatus();
+
+  if (g_webAction != WEB_ACT_NONE && millis() - g_webActionMs >= WEB_ACTION_DELAY_MS) {
+    WebAction a = g_webAction;
+    g_webAction = WEB_ACT_NONE;
+    if (a == WEB_ACT_RESTART) {
+      storage_closeLog();
+      ESP.restart();
+    }
+  }
 }
 
 static void web_stop() {
-  webServer.stop();
+  events_stop();
+  webServer.end();
   Serial.println("[WEB] server stopped");
 }
@@ -0,0 +1,107 @@
+#pragma once
+#include <Arduino.h>
+#include <SdFat.h>
+#include <memory>
+#include "metrics.h"
+
+extern SdFat sd;
+
+// In-RAM copy of the web UI files, so page loads do not touch the SD card
+// (and do not wait for the SPI bus behind the log and history writers).
+// Loaded once the UI on the card is known good (webcache_load after
+// storage_ensureWebUI), dropped when the webui version changes or files
+// under /web are edited. Buffers go to PSRAM when the board has it.
+//
+// Responses hold a reference to the asset they send, so a reload never
+// frees memory that is still being written to a socket.
+
+#define WEBCACHE_MAX_FILE  (64 * 1024)
+
+struct WebAsset {
+  uint8_t* data = nullptr;
+  size_t   len = 0;
+  bool     gzip = false;
+  ~WebAsset() { free(data); }
+};
+
+static const char* const WEBCACHE_PATHS[] = {
+  "/web/index.html",
+  "/web/app.js",
+  "/web/style.css"
+};
+#define WEBCACHE_COUNT  3
+
+static std::shared_ptr<const WebAsset> g_webCache[WEBCACHE_COUNT];
+static char g_webCacheVersion[16] = "";
+static portMUX_TYPE g_webCacheMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void webcache_clear() {
+  std::shared_ptr<const WebAsset> old[WEBCACHE_COUNT];
+  portENTER_CRITICAL(&g_webCacheMux);
+  for (int i = 0; i < WEBCACHE_COUNT; i++) old[i].swap(g_webCache[i]);
+  g_webCacheVersion[0] = 0;
+  portEXIT_CRITICAL(&g_webCacheMux);
+  // old buffers are freed here, outside the critical section, or later by
+  // the last response still sending them
+}
+
+// Reads one file into RAM; prefers the gzip variant like handleStaticFile
+static std::shared_ptr<const WebAsset> webcache_read(const char* path) {
+  char gzPath[40];
+  snprintf(gzPath, sizeof(gzPath), "%s.gz", path);
+  bool gzip = sd.exists(gzPath);
+
+  FsFile f = sd.open(gzip ? gzPath : path, O_RDONLY);
+  if (!f) return nullptr;
+  size_t len = f.size();
+  if (len == 0 || len > WEBCACHE_MAX_FILE) {
+    f.close();
+    return nullptr;
+  }
+
+  auto a = std::make_shared<WebAsset>();
+  a->data = (uint8_t*)(psramFound() ? ps_malloc(len) : malloc(len));
+  a->len = len;
+  a->gzip = gzip;
+  bool ok = a->data && f.read(a->data, len) == (int)len;
+  f.close();
+  return ok ? a : nullptr;
+}
+
+// Call with the storage lock held. No-op while the cached copy matches the
+// given version; an empty version (UI state unknown) leaves nothing cached.
+static void webcache_load(const char* version) {
+  if (version[0] && !strcmp(version, g_webCacheVersion)) return;
+  webcache_clear();
+  if (!version[0]) return;
+
+  std::shared_ptr<const WebAsset> fresh[WEBCACHE_COUNT];
+  size_t bytes = 0;
+  for (int i = 0; i < WEBCACHE_COUNT; i++) {
+    fresh[i] = webcache_read(WEBCACHE_PATHS[i]);
+    if (!fresh[i]) {
+      Serial.printf("[WEB] cache: cannot load %s\n", WEBCACHE_PATHS[i]);
+      return;
+    }
+    bytes += fresh[i]->len;
+  }
+
+  portENTER_CRITICAL(&g_webCacheMux);
+  for (int i = 0; i < WEBCACHE_COUNT; i++) g_webCache[i].swap(fresh[i]);
+  strlcpy(g_webCacheVersion, version, sizeof(g_webCacheVersion));
+  portEXIT_CRITICAL(&g_webCacheMux);
+  Serial.printf("[WEB] cache: UI %s, %u bytes in %s\n", version, (unsigned)bytes, psramFound() ? "PSRAM" : "RAM");
+}
+
+// Cached asset for a /web path, or nullptr
+static std::shared_ptr<const WebAsset> webcache_get(const char* path) {
+  std::shared_ptr<const WebAsset> a;
+  for (int i = 0; i < WEBCACHE_COUNT; i++) {
+    if (strcmp(path, WEBCACHE_PATHS[i]) != 0) continue;
+    portENTER_CRITICAL(&g_webCacheMux);
+    a = g_webCache[i];
+    portEXIT_CRITICAL(&g_webCacheMux);
+    break;
+  }
+  return a;
+}
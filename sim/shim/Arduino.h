@@ -0,0 +1,76 @@
+#pragma once
+// Minimal host stand-in for the Arduino core, just enough for control.h.
+// Time, pins and the ADC are driven by the simulator through the sim:: hooks.
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+using std::min;
+using std::max;
+
+#define LOW  0
+#define HIGH 1
+#define INPUT  0
+#define OUTPUT 1
+
+namespace sim {
+  inline uint64_t nowMs = 0;                     // virtual clock; millis() wraps it like the chip
+  inline int (*adcSource)(uint8_t pin) = nullptr;  // scripted ADC input
+  inline uint8_t pinLevel[40] = {0};
+  inline uint8_t pinMode[40] = {0};
+  inline float chipTempC = 45.0f;
+
+  inline uint32_t ledc[40] = {};                 // last written LEDC duty per pin
+  inline bool verbose = false;                   // echo Serial output to stdout
+}
+
+template <typename T, typename L, typename H>
+static inline T constrain(T v, L lo, H hi) {
+  return v < (T)lo ? (T)lo : (v > (T)hi ? (T)hi : v);
+}
+
+static inline uint32_t millis() { return (uint32_t)sim::nowMs; }
+static inline void delay(uint32_t ms) { sim::nowMs += ms; }
+static inline void yield() {}
+
+static inline void pinMode(uint8_t pin, uint8_t mode) { sim::pinMode[pin] = mode; }
+static inline void digitalWrite(uint8_t pin, uint8_t val) { sim::pinLevel[pin] = val; }
+static inline int digitalRead(uint8_t pin) { return sim::pinLevel[pin]; }
+static inline int analogRead(uint8_t pin) { return sim::adcSource ? sim::adcSource(pin) : 0; }
+static inline void analogReadResolution(uint8_t) {}
+static inline float temperatureRead() { return sim::chipTempC; }
+
+static inline bool ledcAttach(uint8_t, uint32_t, uint8_t) { return true; }
+static inline bool ledcWrite(uint8_t pin, uint32_t duty) {
+  sim::ledc[pin] = duty;
+  return true;
+}
+
+class SimSerial {
+public:
+  void begin(unsigned long) {}
+  template <typename T> void print(const T& v) { if (sim::verbose) put(v); }
+  template <typename T> void println(const T& v) { if (sim::verbose) { put(v); fputc('\n', stdout); } }
+  void println() { if (sim::verbose) fputc('\n', stdout); }
+  int printf(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+    if (!sim::verbose) return 0;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vfprintf(stdout, fmt, ap);
+    va_end(ap);
+    return n;
+  }
+
+private:
+  void put(const char* s) { fputs(s, stdout); }
+  void put(int v) { fprintf(stdout, "%d", v); }
+  void put(unsigned v) { fprintf(stdout, "%u", v); }
+  void put(long v) { fprintf(stdout, "%ld", v); }
+  void put(unsigned long v) { fprintf(stdout, "%lu", v); }
+  void put(double v) { fprintf(stdout, "%.2f", v); }
+};
+
+inline SimSerial Serial;
@@ -0,0 +1,288 @@
+// Host-side simulation of the irrigation control loop.
+//
+// Builds main/control.h against a virtual millis() clock, a scripted soil
+// ADC and an in-memory SD, then replays days of irrigation in seconds while
+// checking the hysteresis / min on-off / window lockout rules.
+//
+//   make && ./irrigation_sim --days 7            (the firmware's 10 ms cycle, tens of sim-h/s)
+//   ./irrigation_sim --days 365 --step-ms 1000   (fast mode, thousands of sim-h/s)
+//
+// The fast mode is the one for regression runs: one control cycle per
+// simulated second still exercises every rule, the log segments and all
+// history tiers. `make check` runs it for a year and the 10 ms cycle for a
+// day; both must report no violations.
+//
+// Exit code is non-zero if any control rule was violated.
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+
+#include "Arduino.h"
+#include "config.h"
+#include "sim_adc.h"
+#include "sim_metrics.h"
+#include "sim_storage.h"
+#include "control.h"
+
+Config cfg;
+Runtime rt;
+Histories hist;
+
+// ---- Soil model (higher ADC = drier soil)
+struct SoilModel {
+  double adc = 2300;
+  double dryPerHour = 120;   // drift while the pump is off
+  double wetPerSec = 2;      // drop while the pump runs at full PWM
+  double noise = 25;         // gaussian ADC noise (1 sigma)
+  double spikeProb = 1e-5;   // chance of a full-scale spike per sample
+  uint64_t rng = 1;
+
+  // xorshift64*: the simulator spends most of its time here, so keep it cheap
+  double uniform() {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (double)((rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  // Approximately gaussian (Irwin-Hall, 4 terms), unit variance
+  double gauss() {
+    return (uniform() + uniform() + uniform() + uniform() - 2.0) * 1.7320508075688772;
+  }
+};
+
+static SoilModel g_soil;
+
+static int simAdc(uint8_t pin) {
+  if (pin != SOIL_PIN) return 0;
+  double v = g_soil.adc + g_soil.noise * g_soil.gauss();
+  if (g_soil.uniform() < g_soil.spikeProb) v = 4095;
+  return (int)constrain(v, 0.0, 4095.0);
+}
+
+// flow: pump PWM as a fraction of full power
+static void soilStep(uint32_t dtMs, double flow) {
+  if (flow > 0) g_soil.adc -= g_soil.wetPerSec * flow * dtMs / 1000.0;
+  else g_soil.adc += g_soil.dryPerHour * dtMs / 3600000.0;
+  g_soil.adc = constrain(g_soil.adc, 800.0, 4000.0);
+}
+
+static void usage() {
+  printf("usage: irrigation_sim [--days N] [--step-ms N] [--noise N] [--spike P]\n"
+         "                      [--dry-rate ADC/h] [--wet-rate ADC/s] [--seed N]\n"
+         "                      [--dry-on N] [--wet-off N] [--mode 0|1|2]\n"
+         "                      [--raw-adc] [--adc-frames N] [--log-csv PATH] [--verbose]\n");
+}
+
+int main(int argc, char** argv) {
+  double days = 1;
+  uint32_t stepMs = 10;  // matches delay(10) in loop()
+  const char* logPath = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    const char* a = argv[i];
+    const char* v = (i + 1 < argc) ? argv[i + 1] : nullptr;
+    if (!strcmp(a, "--verbose")) { sim::verbose = true; continue; }
+    if (!strcmp(a, "--raw-adc")) { simadc::raw = true; continue; }
+    if (!v) { usage(); return 2; }
+    if (!strcmp(a, "--days")) days = atof(v);
+    else if (!strcmp(a, "--step-ms")) stepMs = (uint32_t)atoi(v);
+    else if (!strcmp(a, "--noise")) g_soil.noise = atof(v);
+    else if (!strcmp(a, "--spike")) g_soil.spikeProb = atof(v);
+    else if (!strcmp(a, "--dry-rate")) g_soil.dryPerHour = atof(v);
+    else if (!strcmp(a, "--wet-rate")) g_soil.wetPerSec = atof(v);
+    else if (!strcmp(a, "--seed")) g_soil.rng = (uint64_t)atoll(v) | 1;
+    else if (!strcmp(a, "--dry-on")) cfg.dryOn = atoi(v);
+    else if (!strcmp(a, "--wet-off")) cfg.wetOff = atoi(v);
+    else if (!strcmp(a, "--mode")) cfg.mode = (PumpMode)atoi(v);
+    else if (!strcmp(a, "--adc-frames")) simadc::frames = (uint32_t)atoi(v);
+    else if (!strcmp(a, "--log-csv")) logPath = v;
+    else { usage(); return 2; }
+    i++;
+  }
+  if (stepMs == 0) stepMs = 1;
+  if (simadc::frames == 0) simadc::frames = 1;
+  simadc::stepMs = stepMs;
+
+  sim::adcSource = simAdc;
+  simsd::epochAtMs0 = 1700000000;
+  pump_begin();
+  rt.windowStartMs = millis();
+
+  const uint64_t endMs = (uint64_t)(days * 86400000.0);
+  uint64_t elapsedMs = 0;
+
+  uint32_t cycles = 0, lockouts = 0, violations = 0;
+  uint64_t pumpOnMs = 0;
+  bool wasOn = false, wasLocked = false;
+  uint32_t lastChangeMs = 0;
+
+  auto fail = [&](const char* what) {
+    if (violations++ < 10) {
+      printf("VIOLATION @%llums: %s\n", (unsigned long long)elapsedMs, what);
+    }
+  };
+
+  auto t0 = std::chrono::steady_clock::now();
+
+  while (elapsedMs < endMs) {
+    sim::nowMs += stepMs;
+    elapsedMs += stepMs;
+
+    readSensors();
+    controlPump();
+    updateHistoryAndLog(rt);
+
+    bool on = sim::pinLevel[IN2_PIN] == HIGH;
+    uint32_t duty = sim::ledc[EN1_PIN];
+    if (on != rt.pumpOn) fail("driver direction does not match rt.pumpOn");
+    if (!on && duty != 0) fail("EN PWM active while pump is off");
+    if (on && !cfg.softRamp && duty != (uint32_t)cfg.pumpPwm) fail("EN PWM not at pumpPwm");
+
+    if (rt.pumpOn != wasOn) {
+      uint32_t held = millis() - lastChangeMs;
+      if (rt.pumpOn && lastChangeMs != 0 && held < cfg.minOffMs) fail("min off time");
+      if (!rt.pumpOn && held < cfg.minOnMs && !rt.lockout) fail("min on time");
+      if (rt.pumpOn) cycles++;
+      lastChangeMs = millis();
+      wasOn = rt.pumpOn;
+    }
+    // A start late in the window is still held on for minOnMs past the limit
+    if (rt.onTimeThisWindowMs > cfg.maxOnSecInWindow * 1000UL + cfg.minOnMs + stepMs) {
+      fail("window on-time limit");
+    }
+    if (rt.lockout && !wasLocked) lockouts++;
+    wasLocked = rt.lockout;
+
+    if (rt.pumpOn) pumpOnMs += stepMs;
+    soilStep(stepMs, duty / 255.0);
+  }
+
+  double wallSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  double simHours = elapsedMs / 3600000.0;
+
+  storage_flushLog(true);  // as on restart/OTA
+  uint64_t expectedRows = elapsedMs / cfg.logPeriodMs;
+  if (simsd::logRows + 1 < expectedRows || simsd::logRows > expectedRows) fail("log row count");
+  if (simsd::logBuf.dropped) fail("log lines dropped");
+
+  // Range queries: binary search must agree with a linear scan
+  uint64_t stored = 0;
+  for (const std::string& seg : simsd::segments) stored += simsd_recordCount(seg);
+  if (stored != simsd::logRows) fail("log records lost between buffer and segments");
+
+  uint32_t epochEnd = storage_epochNow();
+  for (int q = 0; q < 200 && epochEnd > 0; q++) {
+    uint32_t span = epochEnd - simsd::epochAtMs0;
+    uint32_t t = simsd::epochAtMs0 + (uint32_t)(g_soil.uniform() * span);
+    for (const std::string& seg : simsd::segments) {
+      uint32_t count = simsd_recordCount(seg);
+      auto readAt = [&](uint32_t n, LogRecord& r) { return simsd_readRecord(seg, n, r); };
+      uint32_t fast = logfmt_lowerBound(readAt, count, t);
+      uint32_t slow = 0;
+      LogRecord r;
+      while (slow < count && simsd_readRecord(seg, slow, r) && r.epoch < t) slow++;
+      if (fast != slow) fail("log range query mismatch");
+    }
+  }
+
+  // Raw ring read oldest-first must match the tail of the log
+  {
+    uint16_t count = history_count(hist.idx, hist.filled, HIST_LEN);
+    std::vector<int16_t> tail;
+    for (auto seg = simsd::segments.rbegin(); seg != simsd::segments.rend() && tail.size() < count; ++seg) {
+      LogRecord r;
+      for (uint32_t n = simsd_recordCount(*seg); n-- > 0 && tail.size() < count;) {
+        if (simsd_readRecord(*seg, n, r)) tail.push_back(r.soil);
+      }
+    }
+    for (uint32_t k = 0; k < count && k < tail.size(); k++) {
+      if (hist.soil[history_slot(hist.idx, hist.filled, HIST_LEN, k)] != tail[count - 1 - k]) {
+        fail("history not chronological");
+        break;
+      }
+      // web replies address entries by sequence number
+      if (history_slotOfSeq(hist.idx, HIST_LEN, hist.seq, hist.seq - (count - 1 - k)) !=
+          history_slot(hist.idx, hist.filled, HIST_LEN, k)) {
+        fail("history slot by sequence number");
+        break;
+      }
+    }
+    // since/step: newest always included, nothing older than since
+    const uint32_t period = cfg.logPeriodMs;
+    const uint64_t newest = 1000000000000ULL;
+    for (uint32_t step = 1; step <= 7; step++) {
+      for (uint32_t back = 0; back < count + 3U; back += 5) {
+        uint64_t since = newest - (uint64_t)back * period;
+        HistRange r = history_range(count, step, period, newest, since);
+        if (count == 0) break;
+        uint32_t expectFirst = back + 1 >= count ? 0 : count - 1 - back;
+        if (r.first >= r.count || (r.count - 1 - r.first) % step != 0 || r.first < expectFirst ||
+            r.first >= expectFirst + step) {
+          fail("history since/step range");
+        }
+      }
+    }
+    // after=seq: exactly the entries numbered above it (those still in the ring)
+    if (hist.seq != simsd::logRows) fail("history sequence number");
+    for (uint32_t back = 0; back < count + 3U; back++) {
+      uint32_t after = hist.seq >= back ? hist.seq - back : 0;
+      HistRange r = history_rangeAfter(count, 1, hist.seq, after);
+      uint32_t want = std::min<uint32_t>(hist.seq - after, count);
+      if (r.count - r.first != want) fail("history after range");
+    }
+  }
+
+  // Rollup tiers: one entry per closed bucket, min <= mean <= max
+  auto checkTier = [&](auto& t, uint32_t len, uint64_t periodMs, const char* name) {
+    uint64_t expected = elapsedMs / periodMs;
+    uint64_t have = t.filled ? len : t.idx;
+    // The bucket in progress at the end may not be closed yet
+    if (expected > len ? !t.filled : (have + 1 < expected || have > expected)) {
+      printf("  %s tier: %llu entries, expected %llu\n", name,
+             (unsigned long long)have, (unsigned long long)expected);
+      fail("history rollup count");
+    }
+    for (uint64_t i = 0; i < have; i++) {
+      const HistRollup& v = t.buf[i];
+      if (v.soilMin > v.soilMean || v.soilMean > v.soilMax || v.pumpPct > 100) {
+        fail("history rollup out of range");
+        break;
+      }
+    }
+  };
+  checkTier(hist.minute, HIST_MIN_LEN, HIST_MIN_PERIOD_MS, "minute");
+  checkTier(hist.hour, HIST_HOUR_LEN, HIST_HOUR_PERIOD_MS, "hour");
+
+  printf("simulated %.1f h in %.3f s (%.0f sim-h/s)\n", simHours, wallSec,
+         wallSec > 0 ? simHours / wallSec : 0.0);
+  printf("pump: %u cycles, %.0f s on (%.2f%%), %u lockouts\n", cycles, pumpOnMs / 1000.0,
+         elapsedMs ? 100.0 * pumpOnMs / elapsedMs : 0.0, lockouts);
+  size_t logBytes = 0;
+  for (const std::string& seg : simsd::segments) logBytes += seg.size();
+  printf("sd: %u log records (%zu bytes, %zu segments) in %u writes, %u history saves"
+         " (%u minute, %u hour)\n",
+         simsd::logRows, logBytes, simsd::segments.size(), simsd::logWrites, simsd::histWrites,
+         simsd::histMinWrites, simsd::histHourWrites);
+  printf("violations: %u\n", violations);
+
+  if (logPath) {
+    // Same conversion as GET /api/log.csv
+    FILE* f = fopen(logPath, "w");
+    if (f) {
+      fputs(LOGFMT_CSV_HEADER, f);
+      char line[96];
+      LogRecord r;
+      for (const std::string& seg : simsd::segments) {
+        for (uint32_t n = 0; simsd_readRecord(seg, n, r); n++) {
+          logfmt_toCsv(r, line, sizeof(line));
+          fputs(line, f);
+        }
+      }
+      fclose(f);
+    }
+  }
+
+  return violations ? 1 : 0;
+}
@@ -0,0 +1,34 @@
+#pragma once
+// Host replacement for adc.h: each control cycle pulls `frames` samples from
+// the scripted analogRead() source and runs them through the same
+// median/IIR filter as the firmware. The firmware sees 10 frames per 10 ms
+// cycle (1 kHz); the default of 1 keeps long runs fast, --adc-frames 10
+// reproduces the real pipeline.
+#include "config.h"
+#include "soilfilter.h"
+
+extern Config cfg;
+
+namespace simadc {
+  inline SoilFilter filter;
+  inline bool raw = false;      // bypass the filter (single analogRead per cycle)
+  inline uint32_t frames = 1;   // samples per control cycle
+  inline uint32_t stepMs = 10;  // control cycle, for the reported rate
+}
+
+static int adc_soil(uint8_t pin) {
+  if (simadc::raw) return analogRead(pin);
+
+  SoilFilter& f = simadc::filter;
+  if (f.medianN != cfg.adcMedianN || f.iirPct != cfg.adcIirPct) {
+    soilfilter_configure(f, cfg.adcMedianN, cfg.adcIirPct);
+  }
+  for (uint32_t i = 0; i < simadc::frames; i++) soilfilter_push(f, analogRead(pin));
+  return soilfilter_output(f);
+}
+
+// Simulated conversions per second, as adc.h reports the real ones
+static uint32_t adc_sampleRateHz() {
+  return (simadc::raw ? 1 : simadc::frames) * 1000 / simadc::stepMs;
+}
+static uint32_t adc_noiseVar() { return (uint32_t)simadc::filter.var; }
@@ -0,0 +1,5 @@
+#pragma once
+// Host replacement for metrics.h: there is no scheduler to measure.
+#include <cstdint>
+
+static uint8_t metrics_cpuPct() { return 0; }
@@ -0,0 +1,86 @@
+#pragma once
+// In-memory SD card for the host simulator. Mirrors the storage_* calls that
+// control.h makes: binary log segments (logfmt.h) staged through the batched
+// writer (logbuf.h), plus the history blobs. Segments are kept in memory so
+// runs can be inspected and range queries checked.
+#include <string>
+#include <vector>
+#include "config.h"
+#include "logbuf.h"
+#include "logfmt.h"
+#include "history.h"
+
+namespace simsd {
+  inline std::vector<std::string> segments;  // /log/NNNNNNNN.bin, header + records
+  inline std::vector<uint8_t> histBlob;      // contents of /hist.bin
+  inline LogBuf logBuf;
+  inline uint32_t segCount = 0;              // records in the last segment, buffered included
+  inline uint32_t logRows = 0;
+  inline uint32_t logWrites = 0;             // write() calls that reached the card
+  inline uint32_t histWrites = 0;
+  inline uint32_t histMinWrites = 0;         // of which rewrote /hist_min.bin
+  inline uint32_t histHourWrites = 0;        // of which rewrote /hist_hour.bin
+  inline uint32_t epochAtMs0 = 0;            // simulated wall clock (0 = not synced)
+  inline uint32_t ntpSyncMs = 3600000;       // clock becomes valid after this
+}
+
+// From the 64-bit sim clock: millis() wraps after 49.7 days, the wall clock does not
+static uint32_t storage_epochNow() {
+  if (sim::nowMs < simsd::ntpSyncMs) return 0;
+  return simsd::epochAtMs0 + (uint32_t)(sim::nowMs / 1000);
+}
+
+static void storage_flushLog(bool force = false) {
+  if (simsd::segments.empty()) return;
+  std::string& seg = simsd::segments.back();
+  size_t n = logbuf_due(simsd::logBuf, seg.size(), millis(), force);
+  if (n == 0) return;
+  seg.append(simsd::logBuf.data, n);
+  simsd::logWrites++;
+  logbuf_consume(simsd::logBuf, n);
+}
+
+static void storage_openSegment() {
+  storage_flushLog(true);
+  LogSegHeader h{};
+  h.magic = LOGSEG_MAGIC;
+  h.version = LOGSEG_VERSION;
+  h.recordSize = sizeof(LogRecord);
+  h.segNo = simsd::segments.size() + 1;
+  h.epochStart = storage_epochNow();
+  h.msStart = millis();
+  simsd::segments.emplace_back(reinterpret_cast<const char*>(&h), sizeof(h));
+  simsd::segCount = 0;
+}
+
+static void storage_appendLog(const Runtime& rt) {
+  if (simsd::segments.empty() || simsd::segCount >= LOGSEG_MAX_RECORDS) storage_openSegment();
+
+  LogRecord r = logfmt_record(rt, storage_epochNow(), millis());
+  if (logbuf_append(simsd::logBuf, (const char*)&r, sizeof(r), millis())) {
+    simsd::segCount++;
+    simsd::logRows++;
+  }
+  storage_flushLog();
+}
+
+// Record n of a flushed segment
+static bool simsd_readRecord(const std::string& seg, uint32_t n, LogRecord& r) {
+  size_t off = sizeof(LogSegHeader) + (size_t)n * sizeof(LogRecord);
+  if (off + sizeof(r) > seg.size()) return false;
+  memcpy(&r, seg.data() + off, sizeof(r));
+  return true;
+}
+
+static uint32_t simsd_recordCount(const std::string& seg) {
+  return (seg.size() - sizeof(LogSegHeader)) / sizeof(LogRecord);
+}
+
+static bool storage_saveHistory(const Histories& h, uint8_t tiers) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(&h);
+  simsd::histBlob.assign(p, p + sizeof(h));
+  simsd::histWrites++;
+  if (tiers & HIST_TIER_MIN) simsd::histMinWrites++;
+  if (tiers & HIST_TIER_HOUR) simsd::histHourWrites++;
+  return true;
+}
@@ -9,14 +9,14 @@ const STATUS_INTERVAL = 3000;
 const HISTORY_INTERVAL = 15000;
 
 // History data storage
-let historyData = { soil: [], temp: [], cpu: [], idx: 0, len: 0 };
+let historyData = { soil: [], temp: [], cpu: [], len: 0, period: 5000, tier: 0, seq: 0, boot: 0, window: 0 };
 let logPeriodMs = 5000; // Default, will be updated from config
 
 // Prevent concurrent requests
 let fetchInProgress = false;
 
-// Fetch JSON helper with timeout
-async function fetchJSON(url, timeoutMs = 5000) {
+// Fetch helper with timeout; read(res) extracts the body
+async function fetchLocked(url, timeoutMs, read) {
   if (fetchInProgress) return null;
   fetchInProgress = true;
 
@@ -28,43 +28,83 @@ async function fetchJSON(url, timeoutMs = 5000) {
     clearTimeout(timeout);
 
     if (!res.ok) throw new Error("HTTP " + res.status);
-    return res.json();
+    return read(res);
   } finally {
     fetchInProgress = false;
   }
 }
 
+function fetchJSON(url, timeoutMs = 5000) {
+  return fetchLocked(url, timeoutMs, res => res.json());
+}
+
+function fetchBuffer(url, timeoutMs = 5000) {
+  return fetchLocked(url, timeoutMs, res => res.arrayBuffer());
+}
+
 // Update timestamp
 function updateTime() {
   $("lastUpdate").textContent = new Date().toLocaleTimeString();
 }
 
+// Show a status object from /api/status or the event stream
+function renderStatus(s) {
+  $("soil").textContent = s.soil;
+  $("temp").textContent = s.tempC.toFixed(1);
+  $("cpu").textContent = s.cpuPct >= 0 ? s.cpuPct + "%" : "n/a";
+
+  const pumpEl = $("pump");
+  pumpEl.textContent = s.pumpOn ? "ON" : "OFF";
+  pumpEl.className = "stat " + (s.pumpOn ? "on" : "off");
+
+  $("lockout").textContent = s.lockout ? "YES" : "No";
+  $("onTime").textContent = s.onTime || 0;
+
+  // Sync mode dropdown if changed externally
+  if ($("mode").value != s.mode) {
+    $("mode").value = s.mode;
+  }
+
+  updateTime();
+}
+
 // Load real-time status
 async function loadStatus() {
+  // Live stream is up: nothing to poll
+  if (liveActive()) return;
+
   try {
     const s = await fetchJSON("/api/status");
     if (!s) return; // Request skipped (another in progress)
+    renderStatus(s);
+  } catch (e) {
+    console.error("Status error:", e);
+  }
+}
 
-    $("soil").textContent = s.soil;
-    $("temp").textContent = s.tempC.toFixed(1);
-    $("cpu").textContent = s.cpuPct + "%";
-
-    const pumpEl = $("pump");
-    pumpEl.textContent = s.pumpOn ? "ON" : "OFF";
-    pumpEl.className = "stat " + (s.pumpOn ? "on" : "off");
+// ---- Live status (Server-Sent Events); polling covers any gap
+const LIVE_STALE_MS = 15000; // device sends at least every 10 s
+let liveLastMs = 0;
 
-    $("lockout").textContent = s.lockout ? "YES" : "No";
-    $("onTime").textContent = s.onTime || 0;
+function liveActive() {
+  return Date.now() - liveLastMs < LIVE_STALE_MS;
+}
 
-    // Sync mode dropdown if changed externally
-    if ($("mode").value != s.mode) {
-      $("mode").value = s.mode;
+function startLive() {
+  if (!window.EventSource) return; // polling only
+  const es = new EventSource("/api/events");
+  es.addEventListener("status", ev => {
+    try {
+      renderStatus(JSON.parse(ev.data));
+      liveLastMs = Date.now();
+    } catch (e) {
+      console.error("Live status error:", e);
     }
-
-    updateTime();
-  } catch (e) {
-    console.error("Status error:", e);
-  }
+  });
+  // The browser retries by itself; a 503 (subscribers full) closes it for good
+  es.onerror = () => {
+    if (es.readyState === EventSource.CLOSED) liveLastMs = 0;
+  };
 }
 
 // Load config values
@@ -148,17 +188,46 @@ async function restart() {
   }
 }
 
-// Update WebUI from GitHub
+// Update WebUI from GitHub. The device syncs in the background; progress is
+// polled and the page reloads once the new files are in place.
 async function updateWebUI() {
-  if (!confirm("Download latest WebUI from GitHub and restart?")) return;
+  if (!confirm("Download latest WebUI from GitHub?")) return;
 
   try {
-    await fetch("/api/webui/update", { method: "POST" });
-    alert("Updating WebUI... Page will reload in 10 seconds.");
-    setTimeout(() => location.reload(), 10000);
+    const res = await fetch("/api/webui/update", { method: "POST" });
+    if (!res.ok && res.status !== 409) throw new Error("HTTP " + res.status);  // 409: already running
   } catch (e) {
     alert("Failed to update WebUI");
+    return;
+  }
+  pollWebUIUpdate();
+}
+
+async function pollWebUIUpdate() {
+  const btn = document.getElementById("webuiBtn");
+  let s;
+  try {
+    const res = await fetch("/api/webui/status");
+    s = await res.json();
+  } catch (e) {
+    setTimeout(pollWebUIUpdate, 2000);
+    return;
   }
+
+  if (s.running) {
+    btn.disabled = true;
+    btn.textContent = s.state === "staging" && s.total
+      ? `Updating ${s.file} ${Math.round(100 * s.bytes / s.total)}%`
+      : `Updating (${s.state})...`;
+    setTimeout(pollWebUIUpdate, 1000);
+    return;
+  }
+
+  btn.disabled = false;
+  btn.textContent = "Update WebUI";
+  if (s.state === "updated") location.reload();
+  else if (s.state === "upToDate") alert("WebUI is up to date (" + s.version + ")");
+  else alert("WebUI update failed");
 }
 
 // Get chart color based on metric
@@ -205,7 +274,7 @@ function drawChart() {
   // Calculate how many points to show based on time window
   let pointsToShow = arr.length;
   if (windowSec > 0) {
-    const pointsPerSec = 1000 / logPeriodMs;
+    const pointsPerSec = 1000 / (historyData.period || logPeriodMs);
     pointsToShow = Math.min(arr.length, Math.ceil(windowSec * pointsPerSec));
   }
 
@@ -282,30 +351,92 @@ function drawChart() {
   ctx.fillText(displayArr.length + " points", w - 10, 15);
 }
 
-// Load history from ESP
+// Decode /api/history.bin: 32-byte header, then one little-endian array per
+// field, oldest first (int16 fields first). Returns typed arrays.
+const HIST_BIN_MAGIC = 0x54534948; // "HIST"
+const HIST_BIN_FIELDS = {
+  0: [["soil", Int16Array], ["temp", Int16Array], ["cpu", Uint8Array]],
+  1: [["soil", Int16Array], ["soilMin", Int16Array], ["soilMax", Int16Array],
+      ["temp", Int16Array], ["cpu", Uint8Array], ["pump", Uint8Array]]
+};
+
+function decodeHistory(buf) {
+  const dv = new DataView(buf);
+  if (buf.byteLength < 32 || dv.getUint32(0, true) !== HIST_BIN_MAGIC) return null;
+
+  const tier = dv.getUint8(5);
+  const count = dv.getUint16(6, true);
+  const h = {
+    tier: tier,
+    len: count,
+    size: dv.getUint16(8, true),
+    period: dv.getUint32(12, true),
+    t: dv.getUint32(16, true),
+    seq: dv.getUint32(20, true),
+    boot: dv.getUint32(24, true),
+    tempScale: dv.getUint16(28, true) || 1
+  };
+
+  let off = 32;
+  for (const [name, Type] of HIST_BIN_FIELDS[tier ? 1 : 0]) {
+    h[name] = new Type(buf, off, count);
+    off += count * Type.BYTES_PER_ELEMENT;
+  }
+  return h;
+}
+
+// a followed by b, keeping only the newest max entries
+function appendTyped(a, b, max) {
+  const total = a.length + b.length;
+  const out = new a.constructor(Math.min(total, max));
+  const skip = total - out.length;
+  if (skip < a.length) out.set(a.subarray(skip));
+  out.set(b.subarray(Math.max(0, skip - a.length)), Math.max(0, a.length - skip));
+  return out;
+}
+
+// Load history from ESP. After the first full load only entries newer than
+// the last seen sequence number are fetched and appended.
 async function loadHistory() {
   try {
-    const h = await fetchJSON("/api/history", 10000); // Longer timeout for history
-    if (!h) return; // Request skipped
-
-    if (h.len > 0) {
-      // Reorder circular buffer to linear array (oldest first)
-      const reorder = (arr, idx, len, filled) => {
-        if (!arr || arr.length === 0) return [];
-        if (!filled) return arr.slice(0, len);
-        // Circular buffer: data from idx to end, then 0 to idx
-        return [...arr.slice(idx), ...arr.slice(0, idx)];
-      };
-
-      const filled = h.len >= 240; // HIST_LEN from config.h
-      historyData.soil = reorder(h.soil, h.idx, h.len, filled);
-      historyData.temp = reorder(h.temp, h.idx, h.len, filled);
-      historyData.cpu = reorder(h.cpu, h.idx, h.len, filled);
-      historyData.len = h.len;
-      historyData.idx = h.idx;
-
-      drawChart();
+    // The device picks raw samples, 1 min or 1 h rollups to cover the window
+    const windowSec = parseInt($("chartWindow").value);
+    const delta = historyData.seq > 0 && historyData.window === windowSec;
+    let url = "/api/history.bin?window=" + windowSec;
+    if (delta) url += "&after=" + historyData.seq;
+
+    const buf = await fetchBuffer(url, 10000); // Longer timeout for history
+    if (!buf) return; // Request skipped
+
+    const h = decodeHistory(buf);
+    if (!h) throw new Error("bad history.bin");
+    const temp = Float32Array.from(h.temp, t => t / h.tempScale);
+
+    if (delta) {
+      // Contiguous with what we have? Otherwise the device restarted or we
+      // fell too far behind: start over with a full load.
+      if (h.boot !== historyData.boot || h.tier !== historyData.tier ||
+          h.seq - h.len !== historyData.seq) {
+        historyData.seq = 0;
+        setTimeout(loadHistory, 0);
+        return;
+      }
+      if (h.len === 0) return;
+      historyData.soil = appendTyped(historyData.soil, h.soil, h.size);
+      historyData.temp = appendTyped(historyData.temp, temp, h.size);
+      historyData.cpu = appendTyped(historyData.cpu, h.cpu, h.size);
+    } else {
+      historyData.soil = h.soil;
+      historyData.temp = temp;
+      historyData.cpu = h.cpu;
     }
+    historyData.len = historyData.soil.length;
+    historyData.period = h.period;
+    historyData.tier = h.tier;
+    historyData.seq = h.seq;
+    historyData.boot = h.boot;
+    historyData.window = windowSec;
+    drawChart();
   } catch (e) {
     console.error("History error:", e);
   }
@@ -446,6 +577,24 @@ async function fsDelete(path) {
   }
 }
 
+// CRC-32 (as zlib), to check an upload against the device's reply
+let crcTable = null;
+function crc32(bytes) {
+  if (!crcTable) {
+    crcTable = new Uint32Array(256);
+    for (let n = 0; n < 256; n++) {
+      let c = n;
+      for (let k = 0; k < 8; k++) c = c & 1 ? (c >>> 1) ^ 0xEDB88320 : c >>> 1;
+      crcTable[n] = c >>> 0;
+    }
+  }
+  let crc = 0xFFFFFFFF;
+  for (let i = 0; i < bytes.length; i++) crc = crcTable[(crc ^ bytes[i]) & 0xFF] ^ (crc >>> 8);
+  return (crc ^ 0xFFFFFFFF) >>> 0;
+}
+
+// The file goes up as one raw body; the device streams it to the card and
+// answers with the size and CRC-32 of what it wrote
 async function fsUpload() {
   const input = $("fsUploadFile");
   if (!input.files || !input.files[0]) {
@@ -457,34 +606,22 @@ async function fsUpload() {
   const path = currentPath + (currentPath === "/" ? "" : "/") + file.name;
 
   try {
-    // Read file and upload in chunks
-    const CHUNK_SIZE = 4096;
-    const reader = new FileReader();
-
-    reader.onload = async function(e) {
-      const data = new Uint8Array(e.target.result);
-      let offset = 0;
-
-      while (offset < data.length) {
-        const chunk = data.slice(offset, offset + CHUNK_SIZE);
-        const append = offset > 0 ? "1" : "0";
-
-        const res = await fetch("/api/fs/upload?path=" + encodeURIComponent(path) + "&append=" + append, {
-          method: "POST",
-          headers: { "Content-Type": "text/plain" },
-          body: String.fromCharCode.apply(null, chunk)
-        });
-
-        if (!res.ok) throw new Error("Upload failed at offset " + offset);
-        offset += chunk.length;
-      }
+    const res = await fetch("/api/fs/upload?path=" + encodeURIComponent(path), {
+      method: "POST",
+      headers: { "Content-Type": "application/octet-stream" },
+      body: file
+    });
+    const data = await res.json().catch(() => ({}));
+    if (!res.ok || !data.ok) throw new Error(data.error || "HTTP " + res.status);
 
-      alert("Upload complete!");
-      input.value = "";
-      fsRefresh();
-    };
+    const crc = crc32(new Uint8Array(await file.arrayBuffer()));
+    if (data.size !== file.size || parseInt(data.crc32, 16) !== crc) {
+      throw new Error("checksum mismatch (" + data.size + " bytes, crc32 " + data.crc32 + ")");
+    }
 
-    reader.readAsArrayBuffer(file);
+    alert("Upload complete!");
+    input.value = "";
+    fsRefresh();
   } catch (e) {
     alert("Upload failed: " + e.message);
   }
@@ -495,7 +632,8 @@ document.addEventListener("DOMContentLoaded", () => {
   loadAll();
   fsLoadDir("/");
 
-  // Auto-refresh status (every 2 seconds)
+  // Status is pushed over /api/events; polling only runs while that is down
+  startLive();
   setInterval(loadStatus, STATUS_INTERVAL);
 
   // Auto-refresh history (every 10 seconds)